@@ -129,21 +129,55 @@ unsigned long current_frame_time = 0;
 unsigned long total_frame_time = 0;
 unsigned long frame_count = 0;
 #endif
+
+#ifndef COMPOSITE_VIDEO
+// Points the screen at the part of the 256x240 image left after the overscan crop, centered
+// on the 320 pixel wide screen at its possibly stretched width
+void setGameWindow(Bus* nes)
+{
+    uint16_t width = nes->ppu.line_width;
+    uint8_t crop_y = nes->ppu.crop_lines;
+    // Clear what the pause menu left over the borders
+    if (width != 256 || crop_y) screen.fillRect(0, 0, 320, 240, TFT_BLACK);
+    nes->setScreenWindow((320 - width) >> 1, crop_y, width, 240 - (crop_y << 1));
+}
+#endif
+
 IRAM_ATTR void emulate()
 {
     Bus nes;
 #ifdef COMPOSITE_VIDEO
-    nes.connectFramebuffer(cv_framebuffer);
+    #ifdef BEAM_RACING
+    nes.connectFramebuffer(beam_ring.lines);
+    #else
+    uint8_t* back_buffer = cv_beginFrames();
+    uint32_t frames_due = 1;
+    nes.connectFramebuffer(back_buffer);
+    #endif
 #else
     ui.loadEmulatorSettings(&nes);
     nes.connectScreen(&screen);
-    screen.setAddrWindow(32, 0, 256, 240);
+    setGameWindow(&nes);
 #endif
     nes.insertCartridge(cart);
     nes.reset();
+#if defined(RUN_AHEAD) && !defined(COMPOSITE_VIDEO)
+    ui.loadGameSettings(&nes);
+#endif
+#ifdef REWIND
+    nes.rewind.begin(&nes);
+#endif
 
+#ifdef AUDIO_CAPTURE
+    nes.cpu.apu.capture.begin(cart->CRC32, SAMPLE_RATE);
+    // SD writes from the APU task need a larger stack
+    const uint32_t apu_task_stack = 4096;
+#else
+    const uint32_t apu_task_stack = 1024;
+#endif
     TaskHandle_t apu_task_handle;
-    xTaskCreatePinnedToCore(apuTask, "APU Task", 1024, &nes.cpu.apu, 1, &apu_task_handle, 0);
+    xTaskCreatePinnedToCore(apuTask, "APU Task", apu_task_stack, &nes.cpu.apu, 1, &apu_task_handle,
+                            0);
 
     TaskHandle_t polling_task_handle;
     xTaskCreatePinnedToCore(pollingTask, "Polling Task", 1024, &nes, 1, &polling_task_handle, 0);
@@ -171,6 +205,13 @@ IRAM_ATTR void emulate()
 // Target frame time: 16639µs (60.098 FPS)
 #define FRAME_TIME 16639
     uint64_t next_frame = esp_timer_get_time();
+#if defined(AUDIO_FRAME_PACING) && !defined(COMPOSITE_VIDEO) && !defined(DEBUG)
+    // Audio samples per frame, kept as whole samples plus a remainder in millionths
+    const uint32_t frame_samples = (uint32_t)SAMPLE_RATE * FRAME_TIME / 1000000;
+    uint32_t frame_sample_frac = 0;
+    uint32_t next_sample = nes.cpu.apu.samples_played;
+    nes.cpu.apu.frame_task = xTaskGetCurrentTaskHandle();
+#endif
     // Emulation Loop
     while (true)
     {
@@ -188,6 +229,10 @@ IRAM_ATTR void emulate()
                 if (time_elapsed_since_start >= demo_mode_runtime)
                 {
                     demo_mode_reset = true;
+#ifdef AUDIO_CAPTURE
+                    // Finish the capture first, the APU task may be writing it to the SD card
+                    nes.cpu.apu.capture.end();
+#endif
                     // turn off audio before restart to prevent speaker popping
                     vTaskSuspend(apu_task_handle);
                     i2s_driver_uninstall(I2S_NUM_0);
@@ -203,27 +248,75 @@ IRAM_ATTR void emulate()
 #ifndef COMPOSITE_VIDEO
             if (!ui.paused)
             {
+    #ifdef AUDIO_CAPTURE
+                // Keep the APU task from being suspended inside an SD write
+                nes.cpu.apu.capture.hold();
+    #endif
                 vTaskSuspend(apu_task_handle);
+    #ifdef RGB444_OUTPUT
+                nes.setScreenRGB444(false);
+    #endif
                 ui.pauseMenu(&nes);
                 vTaskResume(apu_task_handle);
+    #ifdef AUDIO_CAPTURE
+                nes.cpu.apu.capture.release();
+    #endif
                 next_frame = esp_timer_get_time() + FRAME_TIME;
                 nes.controller = 0;
-                screen.setAddrWindow(32, 0, 256, 240);
+                setGameWindow(&nes);
             }
 #else
             if (!cv_paused)
             {
+    #ifdef AUDIO_CAPTURE
+                // Keep the APU task from being suspended inside an SD write
+                nes.cpu.apu.capture.hold();
+    #endif
                 vTaskSuspend(apu_task_handle);
+    #ifdef BEAM_RACING
+                // The frame buffer is only allocated while the menu is open. Without the memory
+                // for it, the game goes on after a notice.
+                if (cv_useFramebuffer(true))
+                {
+                    cv_pauseMenu(&nes);
+                    cv_freeFramebuffer();
+                }
+                else cv_ringNotice("Not enough memory for the menu", 2000);
+    #else
                 cv_pauseMenu(&nes);
+    #endif
                 vTaskResume(apu_task_handle);
+    #ifdef AUDIO_CAPTURE
+                nes.cpu.apu.capture.release();
+    #endif
                 next_frame = esp_timer_get_time() + FRAME_TIME;
                 nes.controller = 0;
             }
 #endif
         }
 
+#ifdef FAST_FORWARD
+        // Select + Right fast-forwards while held
+        nes.setFastForward((nes.controller & (uint8_t)CONTROLLER::Select) &&
+                           (nes.controller & (uint8_t)CONTROLLER::Right));
+#endif
+
+#ifdef REWIND
+        // Select + Left steps back through the rewind history while held
+        bool rewinding = (nes.controller & (uint8_t)CONTROLLER::Select) &&
+                         (nes.controller & (uint8_t)CONTROLLER::Left);
+        if (rewinding) nes.rewind.step();
+#endif
+
+#if defined(COMPOSITE_VIDEO) && !defined(BEAM_RACING)
+        // Video frames worth more than one NES frame are made up for with frames not drawn
+        for (; frames_due > 1; frames_due--) nes.skipFrame();
+#endif
         // Generate one frame
         nes.clock();
+#ifdef REWIND
+        if (!rewinding) nes.rewind.frame();
+#endif
 
 #ifdef DEBUG
         current_frame_time = esp_timer_get_time();
@@ -233,7 +326,28 @@ IRAM_ATTR void emulate()
         if ((frame_count & 63) == 0)
         {
             float avg_fps = (1000000.0 * frame_count) / total_frame_time;
+    #ifdef FRAMESKIP
+            LOGF("FPS: %.2f, skipped %lu/%lu frames (frameskip %u)\n", avg_fps,
+                 (unsigned long)nes.skipped_frames, frame_count, nes.frameskip);
+            nes.skipped_frames = 0;
+    #else
             LOGF("FPS: %.2f\n", avg_fps);
+    #endif
+    #ifdef COMPOSITE_VIDEO
+            if (cv_isr_lines)
+            {
+                LOGF("Video ISR: %lu cycles per line on average, %lu at most\n",
+                     (unsigned long)(cv_isr_cycles / cv_isr_lines),
+                     (unsigned long)cv_isr_max_cycles);
+                cv_isr_cycles = 0;
+                cv_isr_max_cycles = 0;
+                cv_isr_lines = 0;
+            }
+    #endif
+    #ifdef BEAM_RACING
+            LOGF("Beam: %lu lines sent black, %lu late frames\n",
+                 (unsigned long)beam_ring.underruns, (unsigned long)beam_ring.late_frames);
+    #endif
             total_frame_time = 0;
             frame_count = 0;
         }
@@ -241,10 +355,50 @@ IRAM_ATTR void emulate()
         last_frame_time = current_frame_time;
 #endif
 
-#ifndef DEBUG
+#ifdef COMPOSITE_VIDEO
+    // When racing the beam, drawing a frame already waits for the video output
+    #ifndef BEAM_RACING
+        // Frames are shown from the vertical blank on, which paces them. Fast-forwarded frames
+        // are handed over without waiting for it.
+        bool wait_for_blank = true;
+        #ifdef FAST_FORWARD
+        wait_for_blank = !nes.fast_forward;
+        #endif
+        back_buffer = cv_presentFrame(back_buffer, nes.frame_drawn, wait_for_blank, frames_due);
+        nes.connectFramebuffer(back_buffer);
+    #endif
+#elif !defined(DEBUG)
+    #ifdef FAST_FORWARD
+        // No frame limiting while fast-forwarding, pacing restarts from now afterwards
+        if (nes.fast_forward)
+        {
+            next_frame = esp_timer_get_time();
+        #ifdef AUDIO_FRAME_PACING
+            next_sample = nes.cpu.apu.samples_played;
+        #endif
+            continue;
+        }
+    #endif
+    #ifdef AUDIO_FRAME_PACING
+        // Frame limiting, sleep until the audio output has taken a frame's worth of samples
+        frame_sample_frac += (uint32_t)SAMPLE_RATE * FRAME_TIME;
+        next_sample += frame_sample_frac / 1000000;
+        frame_sample_frac %= 1000000;
+
+        // Resync instead of running unthrottled when emulation fell behind
+        int32_t behind = (int32_t)(nes.cpu.apu.samples_played - next_sample);
+        if (behind > (int32_t)frame_samples) next_sample = nes.cpu.apu.samples_played;
+
+        while ((int32_t)(nes.cpu.apu.samples_played - next_sample) < 0)
+        {
+            // Time out in case the APU task is not running
+            if (!ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100))) break;
+        }
+    #else
         // Frame limiting
         uint64_t now = esp_timer_get_time();
         if (now < next_frame) ets_delay_us(next_frame - now);
+    #endif
 #endif
         next_frame += FRAME_TIME;
     }
@@ -307,7 +461,9 @@ void invalidCartridge()
     screen.fillScreen(BG_COLOR);
     screen.setTextColor(TFT_WHITE);
     screen.setTextDatum(MC_DATUM);
-    screen.drawString("ROM Mapper not supported!", screen.width() / 2, screen.height() / 2, 2);
+    const char* message = (cart && cart->outOfMemory()) ? "Not enough memory for this ROM!"
+                                                        : "ROM Mapper not supported!";
+    screen.drawString(message, screen.width() / 2, screen.height() / 2, 2);
 #endif
     delay(3000);
     ESP.restart();
@@ -6,6 +6,7 @@
 #ifndef VIDEO_STANDARD
     #define VIDEO_STANDARD 1 // 0 = PAL, 1 = NTSC
 #endif
+// #define BEAM_RACING // Uncomment to send composite video from a ring of lines instead of a frame buffer (lower latency, the frame buffer is only allocated while the pause menu is open)
 #define AUDIO_PIN 18
 
 // #define CHEAP_YELLOW_DISPLAY_CONF // Uncomment this line if using the CYD
@@ -87,8 +88,20 @@
     #define I2S_LRC_PIN              39 // Word select / Left-Right clock (LRC / WS)
     #define I2S_DOUT_PIN             40 // Serial data output (DIN)
 
-    #define FRAMESKIP
+    #define FRAMESKIP // Skip rendering frames when emulation falls behind
+    // #define AUDIO_FRAME_PACING // Uncomment to pace frames by the audio clock instead of a timer
+    // #define MID_SCANLINE_RENDERING // Uncomment to split lines at mid-scanline PPU writes
+    // #define CHR_TILE_CACHE // Uncomment to cache decoded CHR tile rows (8 KB of RAM)
+    // #define FAST_FORWARD // Uncomment to fast-forward while Select + Right is held
+    // #define REWIND // Uncomment to rewind while Select + Left is held (about 55 KB of RAM)
+    // #define RUN_AHEAD // Uncomment to allow running frames ahead to cut input lag (set per game)
+    // #define DIRTY_STRIPS // Uncomment to only send strips of the screen that changed
+    // #define INTERLACED_RENDERING // Uncomment to draw alternate lines each frame instead of skipping every other frame
+    // #define PARALLEL_RENDERING // Uncomment to draw scanlines on core 0 while core 1 runs the CPU
+    // #define RGB444_OUTPUT // Uncomment to allow sending 12-bit colors to ST7789 screens, set in the settings menu
+    // #define HORIZONTAL_STRETCH // Uncomment to allow widening the picture to 5:4 (320 pixels), set in the settings menu
     // #define DEBUG // Uncomment this line if you want debug prints from serial
+    // #define AUDIO_CAPTURE // Uncomment to record audio and APU timing to the SD card
 
 #endif
 
@@ -63,8 +63,20 @@
 // 0 = GPIO25, 1 = GPIO26
 #define DAC_PIN                  1
 
-#define FRAMESKIP
+#define FRAMESKIP // Skip rendering frames when emulation falls behind
+// #define AUDIO_FRAME_PACING // Uncomment to pace frames by the audio clock instead of a timer
+// #define MID_SCANLINE_RENDERING // Uncomment to split lines at mid-scanline PPU writes
+// #define CHR_TILE_CACHE // Uncomment to cache decoded CHR tile rows (8 KB of RAM)
+// #define FAST_FORWARD // Uncomment to fast-forward while Select + Right is held
+// #define REWIND // Uncomment to rewind while Select + Left is held (about 55 KB of RAM)
+// #define RUN_AHEAD // Uncomment to allow running frames ahead to cut input lag (set per game)
+// #define DIRTY_STRIPS // Uncomment to only send strips of the screen that changed
+// #define INTERLACED_RENDERING // Uncomment to draw alternate lines each frame instead of skipping every other frame
+// #define PARALLEL_RENDERING // Uncomment to draw scanlines on core 0 while core 1 runs the CPU
+// #define RGB444_OUTPUT // Uncomment to allow sending 12-bit colors to ST7789 screens, set in the settings menu
+// #define HORIZONTAL_STRETCH // Uncomment to allow widening the picture to 5:4 (320 pixels), set in the settings menu
 // #define DEBUG // Uncomment this line if you want debug prints from serial
+// #define AUDIO_CAPTURE // Uncomment to record audio and APU timing to the SD card
 
 // When DEMO_MODE_UNLOCKED is defined, if no user input is detected on the ROMs menu within five
 // seconds, then a random game is selected and shown for two minutes. Next the ESP32 is restarted,
@@ -32,6 +32,7 @@
 #include "driver/i2s.h"
 #include "driver/periph_ctrl.h"
 #include "esp_attr.h"
+#include "esp_cpu.h"
 #include "esp_err.h"
 #include "esp_heap_caps.h"
 #include "esp_intr_alloc.h"
@@ -52,7 +53,13 @@
 
 static const int screen_width = 256;
 static const int screen_height = 240;
+#ifdef BEAM_RACING
+// Only shown while a menu is up, games are sent from the PPU's line ring. Freed for loading a
+// cartridge, then reserved again for the pause menu.
+uint8_t* cv_framebuffer = nullptr;
+#else
 uint8_t cv_framebuffer[screen_width * screen_height];
+#endif
 
 // https://wiki.nesdev.com/w/index.php/NTSC_video
 // // NES/SMS have pixel rates of 5.3693175, or 2/3 color clock
@@ -300,12 +307,13 @@ uint32_t us()
 #define P2             (color)
 #define P3             (color << 8)
 
-static uint8_t* _framebuffer;
+static uint8_t* volatile _framebuffer;
 volatile int _line_counter = 0;
 volatile int _frame_counter = 0;
 
 static int _active_lines;
 static int _line_count;
+static uint32_t _frame_us; // Length of a video frame
 
 static int _line_width;
 static int _samples_per_cc;
@@ -339,11 +347,81 @@ static int usec(float us)
 #define PAL_FREQUENCY                 4433618.75
 #define PAL_LINES                     312
 
+// DAC sample words each pixel of a 4 pixel, 12 sample group adds to the group's 6 words: the
+// first word it touches and the second one, shared with a neighbor where the pixel only fills
+// half of it. Built by video_init from the palette of the active standard, one set per PAL line
+// parity, so lines are drawn with whole word stores and no shifting.
+static DRAM_ATTR uint32_t _blit_words[2][8][64];
+
+static void build_blit_words(uint32_t (*words)[64], const uint32_t* palette)
+{
+    for (int c = 0; c < 64; c++)
+    {
+        uint32_t color = palette[c];
+        uint16_t phase[4] = { (uint16_t)P0, (uint16_t)P1, (uint16_t)P2, (uint16_t)P3 };
+        for (int p = 0; p < 4; p++)
+        {
+            // Sample j of the group has phase j & 3 and is the high half of word j / 2 when even
+            uint32_t pixel_words[2] = { 0, 0 };
+            for (int j = p * 3; j < p * 3 + 3; j++)
+            {
+                uint32_t sample = phase[j & 3];
+                pixel_words[(j >> 1) - ((p * 3) >> 1)] |= (j & 1) ? sample : sample << 16;
+            }
+            words[p * 2][c] = pixel_words[0];
+            words[p * 2 + 1][c] = pixel_words[1];
+        }
+    }
+}
+
 void pal_init();
 
+#ifdef BEAM_RACING
+static DRAM_ATTR uint8_t _black_line[256];
+
+// Switches the video output between the frame buffer for the menus, cleared to black, and the
+// PPU's line ring. The frame buffer stays allocated until cv_freeFramebuffer().
+bool cv_useFramebuffer(bool enable)
+{
+    if (enable)
+    {
+        if (!cv_framebuffer) cv_framebuffer = (uint8_t*)malloc(screen_width * screen_height);
+        if (!cv_framebuffer)
+        {
+            LOG("Composite: not enough memory for the menu frame buffer");
+            return false;
+        }
+        memset(cv_framebuffer, 0x0F, screen_width * screen_height);
+        _framebuffer = cv_framebuffer;
+        return true;
+    }
+
+    _framebuffer = nullptr;
+    // The ISR reads the pointer at the start of each line
+    int line = _line_counter;
+    while (_line_counter == line) {}
+    return true;
+}
+
+// Gives the frame buffer's memory back, for loading a cartridge or after the pause menu
+void cv_freeFramebuffer()
+{
+    cv_useFramebuffer(false);
+    free(cv_framebuffer);
+    cv_framebuffer = nullptr;
+    LOGF("Composite: racing the beam, free heap: %u bytes\n",
+         heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+}
+#endif
+
 void video_init(int ntsc)
 {
+#ifdef BEAM_RACING
+    memset(_black_line, 0x0F, sizeof(_black_line));
+    cv_useFramebuffer(true);
+#else
     _framebuffer = cv_framebuffer;
+#endif
     _samples_per_cc = 4;
 
     if (ntsc)
@@ -363,7 +441,11 @@ void video_init(int ntsc)
         _pal_ = 1;
     }
 
+    build_blit_words(_blit_words[0], _palette);
+    if (_pal_) build_blit_words(_blit_words[1], _palette + 64);
+
     _active_lines = 240;
+    _frame_us = _line_count * _line_width / _sample_rate;
     video_init_hw(_line_width, _samples_per_cc); // init the hardware
 }
 
@@ -397,48 +479,6 @@ void pal_init()
     }
 }
 
-void IRAM_ATTR blit_pal(uint8_t* src, uint16_t* dst)
-{
-    uint32_t c, color;
-    bool even = _line_counter & 1;
-    const uint32_t* p = even ? _palette : _palette + 256;
-    int left = 0;
-    int right = 256;
-    uint8_t mask = 0xFF;
-    uint8_t c0, c1, c2, c3, c4;
-    uint8_t y1, y2, y3;
-
-    // case EMU_NES:
-    // 192 of 288 color clocks wide: roughly correct aspect ratio
-    mask = 0x3F;
-    if (!even) p = _palette + 64;
-    dst += 88;
-
-    // 4 pixels over 3 color clocks, 12 samples
-    // do the blitting
-    for (int i = left; i < right; i += 4)
-    {
-        c = *((uint32_t*)(src + i));
-        color = p[c & mask];
-        dst[0 ^ 1] = P0;
-        dst[1 ^ 1] = P1;
-        dst[2 ^ 1] = P2;
-        color = p[(c >> 8) & mask];
-        dst[3 ^ 1] = P3;
-        dst[4 ^ 1] = P0;
-        dst[5 ^ 1] = P1;
-        color = p[(c >> 16) & mask];
-        dst[6 ^ 1] = P2;
-        dst[7 ^ 1] = P3;
-        dst[8 ^ 1] = P0;
-        color = p[(c >> 24) & mask];
-        dst[9 ^ 1] = P1;
-        dst[10 ^ 1] = P2;
-        dst[11 ^ 1] = P3;
-        dst += 12;
-    }
-}
-
 void IRAM_ATTR burst_pal(uint16_t* line)
 {
     line += _burst_start;
@@ -460,46 +500,35 @@ void IRAM_ATTR burst_pal(uint16_t* line)
 // cc == 3 gives 684 samples per line, 3 samples per cc, 3 pixels for 2 cc
 // cc == 4 gives 912 samples per line, 4 samples per cc, 2 pixels per cc
 
-// draw a line of game in NTSC
+// draw a line of game
+// AAA ABB BBC CCC
+// 4 pixels, 3 color clocks, 4 samples per cc
+// each pixel gets 3 samples, 192 color clocks wide
 void IRAM_ATTR blit(uint8_t* src, uint16_t* dst)
 {
-    uint32_t* d = (uint32_t*)dst;
-    const uint32_t* p = _palette;
-    uint32_t color, c;
-    uint32_t mask = 0xFF;
-    int i;
-
+    const uint32_t(*w)[64] = _blit_words[0];
     if (_pal_)
     {
-        blit_pal(src, dst);
-        return;
+        // 192 of 288 color clocks wide: roughly correct aspect ratio
+        dst += 88;
+        if (!(_line_counter & 1)) w = _blit_words[1];
     }
 
-    // case EMU_NES:
-    mask = 0x3F;
-    // AAA ABB BBC CCC
-    // 4 pixels, 3 color clocks, 4 samples per cc
-    // each pixel gets 3 samples, 192 color clocks wide
-    for (i = 0; i < 256; i += 4)
+    uint32_t* d = (uint32_t*)dst;
+    for (int i = 0; i < 256; i += 4)
     {
-        c = *((uint32_t*)(src + i));
-        color = p[c & mask];
-        dst[0 ^ 1] = P0;
-        dst[1 ^ 1] = P1;
-        dst[2 ^ 1] = P2;
-        color = p[(c >> 8) & mask];
-        dst[3 ^ 1] = P3;
-        dst[4 ^ 1] = P0;
-        dst[5 ^ 1] = P1;
-        color = p[(c >> 16) & mask];
-        dst[6 ^ 1] = P2;
-        dst[7 ^ 1] = P3;
-        dst[8 ^ 1] = P0;
-        color = p[(c >> 24) & mask];
-        dst[9 ^ 1] = P1;
-        dst[10 ^ 1] = P2;
-        dst[11 ^ 1] = P3;
-        dst += 12;
+        uint32_t c = *((uint32_t*)(src + i));
+        uint32_t c0 = c & 0x3F;
+        uint32_t c1 = (c >> 8) & 0x3F;
+        uint32_t c2 = (c >> 16) & 0x3F;
+        uint32_t c3 = (c >> 24) & 0x3F;
+        d[0] = w[0][c0];
+        d[1] = w[1][c0] | w[2][c1];
+        d[2] = w[3][c1];
+        d[3] = w[4][c2];
+        d[4] = w[5][c2] | w[6][c3];
+        d[5] = w[7][c3];
+        d += 6;
     }
 }
 
@@ -598,24 +627,114 @@ bool cv_audio_buffer_full(int buffer_size)
     return (_audio_w - _audio_r) + buffer_size > sizeof(_audio_buffer);
 }
 
-// Wait for blanking before starting drawing
-// avoids tearing in our unsynchonized world
-void video_sync()
+// Frame pacing. Frames are drawn into a back buffer that the ISR starts showing at the next
+// vertical blank, where it also wakes the emulation task. The game runs as many frames as the
+// video frames that passed are worth, so NTSC games on PAL output run 6 frames per 5 shown.
+#define NES_FRAME_US 16639 // 60.098 FPS
+
+static uint8_t* _frame_buffers[2];
+static uint8_t* volatile _next_frame = nullptr; // Drawn frame waiting for the vertical blank
+static TaskHandle_t _frame_task = nullptr;
+static int32_t _cadence_us; // Video time not yet made up for by game frames
+
+static inline IRAM_ATTR void vertical_blank()
 {
-    int n = 0;
-    if (_pal_)
+    uint8_t* next = _next_frame;
+    if (next)
     {
-        if (_line_counter < _active_lines) n = (_active_lines - _line_counter) * 1000 / 15600;
+        _framebuffer = next;
+        _next_frame = nullptr;
     }
+    if (_frame_task)
+    {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(_frame_task, &woken);
+        if (woken) portYIELD_FROM_ISR();
+    }
+}
+
+// Starts pacing frames for the calling task, with a second frame buffer if there is memory for
+// one. Without it, frames are drawn into the shown buffer from the vertical blank on, staying
+// ahead of the beam while emulation runs faster than it. Returns the buffer to draw into.
+uint8_t* cv_beginFrames()
+{
+    _frame_buffers[0] = cv_framebuffer;
+    _frame_buffers[1] = (uint8_t*)malloc(screen_width * screen_height);
+    if (_frame_buffers[1]) memcpy(_frame_buffers[1], cv_framebuffer, screen_width * screen_height);
     else
     {
-        if (_line_counter < _active_lines) n = (_active_lines - _line_counter) * 1000 / 15720;
+        LOG("Composite: not enough memory for a back buffer, drawing to the shown frame");
+        _frame_buffers[1] = cv_framebuffer;
     }
-    vTaskDelay(n + 1);
+    _cadence_us = 0;
+    _frame_task = xTaskGetCurrentTaskHandle();
+    return _frame_buffers[1];
 }
 
+// Shows the frame in back from the next vertical blank on if it was drawn, and waits for that
+// blank if wait is set. Sets due to the game frames owed for the video frames that passed, at
+// least 1. Returns the buffer to draw the next frame into.
+uint8_t* cv_presentFrame(uint8_t* back, bool drawn, bool wait, uint32_t& due)
+{
+    uint32_t passed = ulTaskNotifyTake(pdTRUE, 0);
+    if (drawn && back != _framebuffer) _next_frame = back;
+    // Time out in case the video output stopped
+    if (wait) passed += ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+
+    _cadence_us += passed * _frame_us;
+    int32_t frames = _cadence_us / NES_FRAME_US;
+    if (frames > 2)
+    {
+        // Fell far behind, such as after the pause menu, start the cadence over
+        frames = 2;
+        _cadence_us = 0;
+    }
+    if (frames < 1)
+    {
+        // Not waiting for the blank while fast-forwarding, so no video time passed
+        frames = 1;
+        _cadence_us = NES_FRAME_US;
+    }
+    _cadence_us -= frames * NES_FRAME_US;
+    due = frames;
+
+    if (_next_frame) return back; // Not shown yet, keep drawing over it
+    return (_framebuffer == _frame_buffers[0]) ? _frame_buffers[1] : _frame_buffers[0];
+}
+
+// Active line of the picture, from the frame buffer when there is one. Otherwise from the line
+// ring, or black if the PPU has not drawn it yet.
+static inline IRAM_ATTR uint8_t* active_line(int line)
+{
+#ifdef BEAM_RACING
+    uint32_t shown = beam_ring.shown;
+    if (line == 0) beam_ring.frame_start = shown;
+    beam_ring.shown = shown + 1;
+    uint8_t* framebuffer = _framebuffer;
+    if (framebuffer) return framebuffer + (line * 256);
+    if ((int32_t)(beam_ring.ready - shown) <= 0)
+    {
+        if (!beam_ring.blank) beam_ring.underruns++;
+        return _black_line;
+    }
+    return beam_ring.lines + ((line & (BEAM_RING_LINES - 1)) * 256);
+#else
+    return _framebuffer + (line * 256);
+#endif
+}
+
+#ifdef DEBUG
+// Time spent in the video ISR, to see how much of core 0 it takes
+volatile uint32_t cv_isr_cycles = 0;     // Total since the counters were last cleared
+volatile uint32_t cv_isr_max_cycles = 0; // Longest line
+volatile uint32_t cv_isr_lines = 0;
+#endif
+
 void IRAM_ATTR video_isr(volatile void* vbuf)
 {
+#ifdef DEBUG
+    uint32_t isr_start = esp_cpu_get_cycle_count();
+#endif
     uint8_t s =
         _audio_r < _audio_w ? _audio_buffer[_audio_r++ & (sizeof(_audio_buffer) - 1)] : 0x40;
     audio_sample(s);
@@ -623,6 +742,7 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
 
     int i = _line_counter++;
     uint16_t* buf = (uint16_t*)vbuf;
+    if (i == (_pal_ ? _active_lines + 32 : _active_lines)) vertical_blank();
     if (_pal_)
     {
         // pal
@@ -634,7 +754,7 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
         { // active video 32-272
             sync(buf, _hsync);
             burst(buf);
-            blit(_framebuffer + ((i - 32) * 256), buf + _active_start);
+            blit(active_line(i - 32), buf + _active_start);
         }
         else if (i < 304)
         {                // post render/black 272-304
@@ -653,7 +773,7 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
         { // active video
             sync(buf, _hsync);
             burst(buf);
-            blit(_framebuffer + (i * 256), buf + _active_start);
+            blit(active_line(i), buf + _active_start);
         }
         else if (i < (_active_lines + 5))
         { // post render/black
@@ -674,6 +794,13 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
         _line_counter = 0; // frame is done
         _frame_counter++;
     }
+
+#ifdef DEBUG
+    uint32_t cycles = esp_cpu_get_cycle_count() - isr_start;
+    cv_isr_cycles += cycles;
+    if (cycles > cv_isr_max_cycles) cv_isr_max_cycles = cycles;
+    cv_isr_lines++;
+#endif
 }
 
 void composite_video_stop_dma()
@@ -889,6 +1016,28 @@ inline constexpr int cv_text_width(const char* str)
     return width;
 }
 
+#ifdef BEAM_RACING
+// Shows a line of text for ms milliseconds without a frame buffer. Every ring line is marked as
+// drawn, so the ISR repeats the ring down the screen until the PPU draws again.
+void cv_ringNotice(const char* text, uint32_t ms)
+{
+    memset(beam_ring.lines, CV_BLACK, sizeof(beam_ring.lines));
+    int x = (screen_width - cv_text_width(text)) / 2;
+    for (; *text; text++, x += 8)
+    {
+        const uint8_t* glyph = (const uint8_t*)font8x8_basic[(uint8_t)*text & 0x7F];
+        for (int row = 0; row < 8; row++)
+            for (int col = 0; col < 8; col++)
+                if (glyph[row] & (1 << col))
+                    beam_ring.lines[(12 + row) * SCANLINE_SIZE + x + col] = CV_WHITE;
+    }
+    beam_ring.ready = beam_ring.shown + 0x40000000;
+    delay(ms);
+    // Back to black until the PPU draws again, so the notice is not repeated over later frames
+    beam_ring.ready = beam_ring.shown;
+}
+#endif
+
 inline void cv_getNesFiles(std::vector<std::string>& files)
 {
     File root = SD.open("/");
@@ -1012,6 +1161,10 @@ Cartridge* cv_selectGame()
         {
             std::string game = "/" + files[selected];
             std::vector<std::string>().swap(files);
+#ifdef BEAM_RACING
+            // Free the frame buffer before the cartridge allocates its memory
+            cv_freeFramebuffer();
+#endif
             return new Cartridge(game.c_str(), ROMBackend::FLASH);
         }
     }
@@ -238,6 +238,13 @@ void Apu2A03::setVolume(uint8_t vol)
     volume = vol;
 }
 
+// Runs the APU speed times faster than the audio output by taking fewer samples per clock,
+// so fast-forwarded sound stays in step with the game instead of lagging behind
+void Apu2A03::setSpeed(uint8_t speed)
+{
+    sample_step = SAMPLE_RATE / speed;
+}
+
 void Apu2A03::clock()
 {
     // Clock all sound channels
@@ -326,7 +333,7 @@ void Apu2A03::clock()
     // Put sound channels output into audio buffers
     // Generate sample every 20.29221088 clocks
     // (1.789773 MHz / 2) / 44100 Hz
-    pulse_hz += SAMPLE_RATE;
+    pulse_hz += sample_step;
     if (pulse_hz > 894886)
     {
         // Mute sound channels if muted
@@ -388,6 +395,12 @@ inline void Apu2A03::generateSample()
 
 inline void Apu2A03::writeBuffer()
 {
+#ifdef AUDIO_CAPTURE
+    // Time spent generating this block, excluding the wait on the audio output. The first block
+    // has no start time and is recorded without one.
+    uint64_t now = esp_timer_get_time();
+    capture.writeBlock(audio_buffer, AUDIO_BUFFER_SIZE, block_start ? now - block_start : 0);
+#endif
 #ifndef COMPOSITE_VIDEO
     static size_t dummy;
     i2s_write(I2S_NUM_0, audio_buffer, sizeof(audio_buffer), &dummy, portMAX_DELAY);
@@ -395,6 +408,13 @@ inline void Apu2A03::writeBuffer()
     while (cv_audio_buffer_full(AUDIO_BUFFER_SIZE)) vTaskDelay(1);
     cv_audio_write_16((const uint16_t*)audio_buffer, AUDIO_BUFFER_SIZE, 2);
 #endif
+#ifdef AUDIO_CAPTURE
+    block_start = esp_timer_get_time();
+#endif
+#ifdef AUDIO_FRAME_PACING
+    samples_played += AUDIO_BUFFER_SIZE;
+    if (frame_task) xTaskNotifyGive(frame_task);
+#endif
 }
 
 inline void Apu2A03::pulseChannelClock(sequencerUnit& seq, bool enable)
@@ -14,6 +14,10 @@
 #endif
 #define AUDIO_BUFFER_SIZE 128
 
+#ifdef AUDIO_CAPTURE
+    #include "audio_capture.h"
+#endif
+
 class Bus;
 class Cpu6502;
 class Apu2A03
@@ -34,6 +38,7 @@ public:
     void cpuWrite(uint16_t addr, uint8_t data);
     uint8_t cpuRead(uint16_t addr);
     void setVolume(uint8_t vol);
+    void setSpeed(uint8_t speed);
     void clock();
     void reset();
     static uint16_t audio_buffer[AUDIO_BUFFER_SIZE * 2];
@@ -42,14 +47,26 @@ public:
     bool IRQ = false;
     uint16_t buffer_index = 0;
     uint8_t volume = 100;
+#ifdef AUDIO_CAPTURE
+    AudioCapture capture;
+#endif
+#ifdef AUDIO_FRAME_PACING
+    // Samples accepted by the audio output, notifies frame_task after every block
+    volatile uint32_t samples_played = 0;
+    TaskHandle_t frame_task = nullptr;
+#endif
 
 private:
     Bus* bus = nullptr;
     Cpu6502* cpu = nullptr;
     uint32_t clock_counter = 0;
     uint32_t pulse_hz = 0;
+    uint32_t sample_step = SAMPLE_RATE; // Added to pulse_hz every clock, lower plays faster
     uint16_t prev_sample = 0;
     bool four_step_sequence_mode = true;
+#ifdef AUDIO_CAPTURE
+    uint64_t block_start = 0;
+#endif
 
     // double pulse_out = 0.0;
     // double tnd_out = 0.0;
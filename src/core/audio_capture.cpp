@@ -0,0 +1,159 @@
+#include "audio_capture.h"
+#include "../debug.h"
+
+static inline void write16(uint8_t* p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void write32(uint8_t* p, uint32_t v)
+{
+    write16(p, v & 0xFFFF);
+    write16(p + 2, v >> 16);
+}
+
+void wavHeader(uint8_t* header, uint32_t sample_rate, uint32_t data_size)
+{
+    memcpy(header, "RIFF", 4);
+    write32(header + 4, WAV_HEADER_SIZE - 8 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write32(header + 16, 16);          // fmt chunk size
+    write16(header + 20, 1);           // PCM
+    write16(header + 22, 1);           // Mono
+    write32(header + 24, sample_rate); // Sample rate
+    write32(header + 28, sample_rate); // Byte rate
+    write16(header + 32, 1);           // Block align
+    write16(header + 34, 8);           // Bits per sample
+    memcpy(header + 36, "data", 4);
+    write32(header + 40, data_size);
+}
+
+bool AudioCapture::begin(uint32_t CRC32, uint32_t sample_rate)
+{
+    if (!lock) lock = xSemaphoreCreateMutex();
+    pcm = (uint8_t*)malloc(AUDIO_CAPTURE_BUFFER_SIZE);
+    timing_buffer = (char*)malloc(AUDIO_CAPTURE_TIMING_SIZE);
+    if (!lock || !pcm || !timing_buffer)
+    {
+        LOG("Audio capture: not enough memory");
+        freeBuffers();
+        return false;
+    }
+
+    if (!SD.exists("/captures")) SD.mkdir("/captures");
+
+    static char filename[32];
+    sprintf(filename, "/captures/%08lX.wav", (unsigned long)CRC32);
+    wav = SD.open(filename, FILE_WRITE);
+    sprintf(filename, "/captures/%08lX.csv", (unsigned long)CRC32);
+    timing = SD.open(filename, FILE_WRITE);
+    if (!wav || !timing)
+    {
+        LOG("Audio capture: failed to open capture files");
+        if (wav) wav.close();
+        if (timing) timing.close();
+        freeBuffers();
+        return false;
+    }
+
+    this->sample_rate = sample_rate;
+    data_size = 0;
+    block_count = 0;
+    log_samples = 0;
+    log_us = 0;
+    pcm_index = 0;
+    timing_index = 0;
+
+    uint8_t header[WAV_HEADER_SIZE];
+    wavHeader(header, sample_rate, 0);
+    wav.write(header, WAV_HEADER_SIZE);
+    timing.print("block,us\n");
+
+    active = true;
+    LOGF("Audio capture: recording to %s\n", filename);
+    return true;
+}
+
+void AudioCapture::writeBlock(const uint16_t* buffer, uint16_t samples, uint32_t elapsed_us)
+{
+    if (!active) return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // Ended while waiting for the lock
+    if (!active)
+    {
+        xSemaphoreGive(lock);
+        return;
+    }
+
+    // The APU buffer holds duplicated stereo frames with an 8-bit sample in the high byte
+    for (int i = 0; i < samples; i++) pcm[pcm_index++] = buffer[i << 1] >> 8;
+    timing_index += sprintf(timing_buffer + timing_index, "%lu,%lu\n", (unsigned long)block_count,
+                            (unsigned long)elapsed_us);
+    block_count++;
+
+    log_samples += samples;
+    log_us += elapsed_us;
+    if ((block_count % AUDIO_CAPTURE_LOG_BLOCKS) == 0 && log_us)
+    {
+        LOGF("APU: %lu samples/s (%lu us/block)\n",
+             (unsigned long)((uint64_t)log_samples * 1000000 / log_us),
+             (unsigned long)(log_us / AUDIO_CAPTURE_LOG_BLOCKS));
+        log_samples = 0;
+        log_us = 0;
+    }
+
+    if (pcm_index + samples > AUDIO_CAPTURE_BUFFER_SIZE ||
+        timing_index + 24U > AUDIO_CAPTURE_TIMING_SIZE)
+        flush();
+    xSemaphoreGive(lock);
+}
+
+void AudioCapture::flush()
+{
+    wav.write(pcm, pcm_index);
+    timing.write((const uint8_t*)timing_buffer, timing_index);
+    data_size += pcm_index;
+    pcm_index = 0;
+    timing_index = 0;
+
+    // Keep the header valid so the file is playable even if power is cut
+    uint8_t header[WAV_HEADER_SIZE];
+    wavHeader(header, sample_rate, data_size);
+    wav.seek(0);
+    wav.write(header, WAV_HEADER_SIZE);
+    wav.seek(WAV_HEADER_SIZE + data_size);
+    wav.flush();
+    timing.flush();
+}
+
+void AudioCapture::end()
+{
+    if (!active) return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    flush();
+    wav.close();
+    timing.close();
+    active = false;
+    freeBuffers();
+    xSemaphoreGive(lock);
+}
+
+// Waits for the block being written to finish and keeps the APU task from starting another
+void AudioCapture::hold()
+{
+    if (lock) xSemaphoreTake(lock, portMAX_DELAY);
+}
+
+void AudioCapture::release()
+{
+    if (lock) xSemaphoreGive(lock);
+}
+
+void AudioCapture::freeBuffers()
+{
+    free(pcm);
+    free(timing_buffer);
+    pcm = nullptr;
+    timing_buffer = nullptr;
+}
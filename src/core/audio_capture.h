@@ -0,0 +1,49 @@
+#ifndef AUDIO_CAPTURE_H
+#define AUDIO_CAPTURE_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include <cstdint>
+
+#define WAV_HEADER_SIZE            44
+#define AUDIO_CAPTURE_BUFFER_SIZE  4096 // Samples buffered in RAM between SD writes
+#define AUDIO_CAPTURE_LOG_BLOCKS   1024 // Blocks between throughput reports
+#define AUDIO_CAPTURE_TIMING_SIZE  1024 // Bytes of timing text buffered between SD writes
+
+// Fills a 44 byte RIFF header for mono 8-bit unsigned PCM
+void wavHeader(uint8_t* header, uint32_t sample_rate, uint32_t data_size);
+
+// Records the APU output to /captures/<CRC32>.wav and the time spent generating
+// each block to /captures/<CRC32>.csv. Blocks are written from the APU task, so other tasks
+// hold() the capture before suspending it, which keeps it from being stopped in an SD write.
+class AudioCapture
+{
+public:
+    bool begin(uint32_t CRC32, uint32_t sample_rate);
+    void writeBlock(const uint16_t* buffer, uint16_t samples, uint32_t elapsed_us);
+    void end();
+    void hold();
+    void release();
+
+    volatile bool active = false;
+
+private:
+    File wav;
+    File timing;
+    uint32_t sample_rate = 0;
+    uint32_t data_size = 0;
+    uint32_t block_count = 0;
+    uint32_t log_samples = 0;
+    uint32_t log_us = 0;
+    uint16_t pcm_index = 0;
+    uint16_t timing_index = 0;
+    // Heap allocated, the capture lives inside the Bus on the loop task's stack
+    uint8_t* pcm = nullptr;
+    char* timing_buffer = nullptr;
+    SemaphoreHandle_t lock = nullptr;
+
+    void flush();
+    void freeBuffers();
+};
+
+#endif
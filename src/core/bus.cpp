@@ -10,10 +10,17 @@ Bus::Bus()
 
 Bus::~Bus()
 {
+#ifdef RUN_AHEAD
+    free(run_ahead_state);
+#endif
 }
 
 IRAM_ATTR void Bus::cpuWrite(uint16_t addr, uint8_t data)
 {
+#ifdef PARALLEL_RENDERING
+    // Bank switches, mirroring changes and OAM DMA change what the renderer reads
+    if (addr >= 0x8000 || addr == 0x4014) ppu.beforeSharedWrite();
+#endif
     if (cart->cpuWrite(addr, data)) {}
     else if ((addr & 0xE000) == 0x0000) { RAM[addr & 0x07FF] = data; }
     else if ((addr & 0xE000) == 0x2000) { ppu.cpuWrite(addr & 0x0007, data); }
@@ -54,6 +61,42 @@ void Bus::reset()
 }
 
 IRAM_ATTR void Bus::clock()
+{
+#ifdef RUN_AHEAD
+    if (run_ahead && runAhead()) return;
+#endif
+#ifdef FRAMESKIP
+    uint64_t frame_start = esp_timer_get_time();
+    bool frame_latch = skip_counter < frameskip;
+#elif defined(FAST_FORWARD)
+    bool frame_latch = false;
+#else
+    const bool frame_latch = false;
+#endif
+#ifdef FAST_FORWARD
+    // Only the last of every FAST_FORWARD_SPEED frames is drawn while fast-forwarding
+    if (fast_forward)
+    {
+        if (++fast_forward_counter >= FAST_FORWARD_SPEED) fast_forward_counter = 0;
+        frame_latch = fast_forward_counter != 0;
+    }
+#endif
+#if defined(INTERLACED_RENDERING) && defined(FRAMESKIP)
+    if (frameskip == 1 && runField(frame_start)) return;
+#endif
+    runFrame(frame_latch);
+
+#ifdef FRAMESKIP
+    #ifdef FAST_FORWARD
+    // Fast-forwarded frames would throw off the frame cost averages
+    if (fast_forward) return;
+    #endif
+    updateFrameskip(frame_latch, esp_timer_get_time() - frame_start);
+#endif
+}
+
+// Emulates one frame, only drawing it if frame_latch is not set
+IRAM_ATTR void Bus::runFrame(bool frame_latch)
 {
     // 1 frame == 341 dots * 261 scanlines
     // Visible scanlines 0-239
@@ -64,20 +107,27 @@ IRAM_ATTR void Bus::clock()
     // 1 scanline == ~113.67 CPU clocks, so for every 3 scanlines, two scanlines will have an extra
     // CPU clock
 
-    static bool frame_latch = false;
+#ifdef MID_SCANLINE_RENDERING
+    ppu.beginFrame();
+#endif
     for (int ppu_scanline = 0; ppu_scanline < 240; ppu_scanline += 3)
     {
-        cpu.clock(113);
+        clockScanline(113);
         if (!frame_latch) ppu.renderScanline(ppu_scanline);
         else ppu.fakeSpriteHit(ppu_scanline);
 
-        cpu.clock(114);
+        clockScanline(114);
         if (!frame_latch) ppu.renderScanline(ppu_scanline + 1);
         else ppu.fakeSpriteHit(ppu_scanline + 1);
 
-        cpu.clock(114);
+        clockScanline(114);
         if (!frame_latch) ppu.renderScanline(ppu_scanline + 2);
         else ppu.fakeSpriteHit(ppu_scanline + 2);
+
+#if !defined(COMPOSITE_VIDEO) && !defined(PARALLEL_RENDERING)
+        // Keep the DMA busy with queued buffers
+        pumpImages();
+#endif
     }
 
     // Setup for the next frame
@@ -91,12 +141,186 @@ IRAM_ATTR void Bus::clock()
 
     ppu.clearVBlank();
     cpu.clock(114);
+#ifdef COMPOSITE_VIDEO
+    frame_drawn = !frame_latch;
+    #ifdef BEAM_RACING
+    // Frames that are not drawn, such as fast-forwarded ones, leave nothing in the ring. Once the
+    // last drawn line is sent, the beam gets black lines until the next drawn frame.
+    if (frame_latch) beam_ring.blank = true;
+    #endif
+#else
+    if (!frame_latch)
+    {
+    #ifdef PARALLEL_RENDERING
+        ppu.waitForRenderer();
+    #endif
+        flushImages();
+    }
+#endif
+}
 
-#ifdef FRAMESKIP
-    frame_latch = !frame_latch;
+#ifdef COMPOSITE_VIDEO
+// Emulates a frame without drawing it, for video output that shows fewer frames than the NES
+void Bus::skipFrame()
+{
+    runFrame(true);
+}
+#endif
+
+#if defined(INTERLACED_RENDERING) && defined(FRAMESKIP)
+// Instead of skipping every other frame, draws the even lines of one frame and the odd lines of
+// the next, so motion still updates every frame at about the same cost
+bool Bus::runField(uint64_t frame_start)
+{
+    #ifdef FAST_FORWARD
+    if (fast_forward) return false;
+    #endif
+    ppu.field = field_parity;
+    field_parity ^= 1;
+    runFrame(false);
+    ppu.field = -1;
+
+    // A field costs about half a drawn and half a skipped frame, so the cost of a drawn frame is
+    // estimated from it to keep the frameskip averages meaningful
+    uint32_t elapsed = esp_timer_get_time() - frame_start;
+    uint32_t estimate = elapsed << 1;
+    estimate = (estimate > skip_cost) ? estimate - skip_cost : elapsed;
+    updateFrameskip(false, estimate);
+    return true;
+}
+#endif
+
+#ifdef RUN_AHEAD
+// Emulates the real frame without drawing it, saves the state, runs run_ahead more frames with
+// only the last one drawn, then goes back to the saved state. The screen shows where the game
+// will be, so input shows up run_ahead frames sooner. Returns false when there is no time for it.
+bool Bus::runAhead()
+{
+    #ifdef FRAMESKIP
+    if (frameskip) return false;
+    #endif
+    #ifdef FAST_FORWARD
+    if (fast_forward) return false;
+    #endif
+    if (run_ahead_retry)
+    {
+        run_ahead_retry--;
+        return false;
+    }
+    if (!run_ahead_state)
+    {
+        run_ahead_size = stateSize();
+        run_ahead_state = (uint8_t*)malloc(run_ahead_size);
+        if (!run_ahead_state)
+        {
+            LOG("Run-ahead: not enough memory for a state");
+            run_ahead = 0;
+            return false;
+        }
+    }
+
+    uint64_t frame_start = esp_timer_get_time();
+    runFrame(true);
+
+    MemoryStateStream save(run_ahead_state, run_ahead_size);
+    dumpState(save);
+    // The joypad latch is not part of a state, but the frames run ahead shift it. A game that
+    // strobes once and reads across the frame boundary has to find it where it was left.
+    uint8_t saved_controller_state = controller_state;
+    uint8_t saved_controller_strobe = controller_strobe;
+
+    // Sound from frames that will be rolled back is dropped
+    cpu.mute_apu = true;
+    for (int i = 1; i <= run_ahead; i++) runFrame(i != run_ahead);
+    cpu.mute_apu = false;
+
+    MemoryStateStream restore(run_ahead_state, run_ahead_size);
+    loadState(restore);
+    controller_state = saved_controller_state;
+    controller_strobe = saved_controller_strobe;
+
+    // Fall back to normal frames for a while when running ahead takes too long
+    uint32_t elapsed = esp_timer_get_time() - frame_start;
+    run_ahead_cost = run_ahead_cost ? (run_ahead_cost * 7 + elapsed) >> 3 : elapsed;
+    if (run_ahead_cost > RUN_AHEAD_BUDGET)
+    {
+        LOGF("Run-ahead: %lu us per frame, paused\n", (unsigned long)run_ahead_cost);
+        run_ahead_cost = 0;
+        run_ahead_retry = RUN_AHEAD_RETRY;
+    }
+    return true;
+}
+#endif
+
+#ifdef FAST_FORWARD
+void Bus::setFastForward(bool enable)
+{
+    if (enable == fast_forward) return;
+    fast_forward = enable;
+    fast_forward_counter = 0;
+    cpu.apu.setSpeed(enable ? FAST_FORWARD_SPEED : 1);
+}
+#endif
+
+// Runs the CPU for one scanline, setting a predicted sprite 0 hit at its cycle
+inline void Bus::clockScanline(int cycles)
+{
+    int16_t hit = ppu.sprite_zero_cycle;
+    if (hit < 0)
+    {
+        cpu.clock(cycles);
+        return;
+    }
+
+    ppu.sprite_zero_cycle = -1;
+    if (hit > cycles) hit = cycles;
+    cpu.clock(hit);
+    ppu.setSpriteZeroHit();
+#ifdef MID_SCANLINE_RENDERING
+    cpu.batch_offset = hit;
+    cpu.clock(cycles - hit);
+    cpu.batch_offset = 0;
+#else
+    cpu.clock(cycles - hit);
 #endif
 }
 
+#ifdef FRAMESKIP
+// Picks how many frames to skip after each rendered one from the measured cost of rendered and
+// skipped frames. Skips more as soon as the budget is exceeded, and less only after the lower
+// setting has fit with headroom for FRAMESKIP_HOLD frames in a row.
+inline void Bus::updateFrameskip(bool skipped, uint32_t elapsed)
+{
+    if (skipped)
+    {
+        skip_cost = skip_cost ? (skip_cost * 7 + elapsed) >> 3 : elapsed;
+        skipped_frames++;
+        skip_counter++;
+        return;
+    }
+    render_cost = render_cost ? (render_cost * 7 + elapsed) >> 3 : elapsed;
+    skip_counter = 0;
+
+    // Average frame time when skipping n frames after each rendered one
+    auto average = [this](uint32_t n) { return (render_cost + n * skip_cost) / (n + 1); };
+
+    if (frameskip < MAX_FRAMESKIP && average(frameskip) > FRAMESKIP_BUDGET)
+    {
+        frameskip++;
+        frameskip_hold = 0;
+    }
+    else if (frameskip > 0 && average(frameskip - 1) < FRAMESKIP_BUDGET - FRAMESKIP_BUDGET / 8)
+    {
+        if (++frameskip_hold >= FRAMESKIP_HOLD)
+        {
+            frameskip--;
+            frameskip_hold = 0;
+        }
+    }
+    else frameskip_hold = 0;
+}
+#endif
+
 IRAM_ATTR void Bus::setPPUMirrorMode(Cartridge::MIRROR mirror)
 {
     ppu.setMirror(mirror);
@@ -109,7 +333,7 @@ Cartridge::MIRROR Bus::getPPUMirrorMode()
 
 IRAM_ATTR void Bus::OAM_Write(uint8_t addr, uint8_t data)
 {
-    ppu.ptr_sprite[addr] = data;
+    ppu.OAMWrite(addr, data);
 }
 
 void Bus::insertCartridge(Cartridge* cartridge)
@@ -123,6 +347,12 @@ void Bus::insertCartridge(Cartridge* cartridge)
 void Bus::connectScreen(TFT_eSPI* screen)
 {
     ptr_screen = screen;
+#ifdef PARALLEL_RENDERING
+    ppu.startRenderer();
+#endif
+#ifndef COMPOSITE_VIDEO
+    ppu.display().allocDisplayRing();
+#endif
 }
 
 void Bus::connectFramebuffer(uint8_t* framebuffer)
@@ -130,16 +360,173 @@ void Bus::connectFramebuffer(uint8_t* framebuffer)
     ppu.connectFramebuffer(framebuffer);
 }
 
+// Sets where on the screen the visible part of the frame is drawn
+void Bus::setScreenWindow(int32_t x, int32_t y, int32_t w, int32_t h)
+{
+#ifndef COMPOSITE_VIDEO
+    flushImages();
+#endif
+    window_x = x;
+    window_y = y;
+    window_w = w;
+    window_h = h;
+#ifdef RGB444_OUTPUT
+    setScreenRGB444(ppu.rgb444);
+#endif
+    ptr_screen->setAddrWindow(x, y, w, h);
+#ifdef DIRTY_STRIPS
+    // Whatever was drawn over the window has to be replaced
+    memset(strip_hash, 0, sizeof(strip_hash));
+#endif
+    next_line = 0;
+    window_line = 0;
+}
+
+#ifdef RGB444_OUTPUT
+// Switches the screen between 12 and 16 bits per pixel. Menus are always drawn in 16 bits.
+void Bus::setScreenRGB444(bool enable)
+{
+    flushImages();
+    ptr_screen->writecommand(0x3A); // COLMOD
+    ptr_screen->writedata(enable ? 0x53 : 0x55);
+}
+#endif
+
+#ifdef DIRTY_STRIPS
+// FNV-1a over pixel pairs, never 0 so a cleared hash always differs
+static inline uint32_t hashStrip(const uint16_t* pixels, uint32_t count)
+{
+    const uint32_t* words = (const uint32_t*)pixels;
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < (count >> 1); i++) hash = (hash ^ words[i]) * 16777619U;
+    return hash | 1;
+}
+#endif
+
+// Queues the filled display buffer to be sent and moves the PPU on to the next free one,
+// waiting only when every buffer in the ring is queued or sending
 IRAM_ATTR void Bus::renderImage(uint16_t scanline)
 {
 #ifndef COMPOSITE_VIDEO
+    Ppu2C02& video = ppu.display();
+    uint8_t line = scanline - video.crop_lines; // Row in the screen window
+    #ifdef INTERLACED_RENDERING
+    bool field = video.field >= 0;
+    #else
+    const bool field = false;
+    #endif
+    #ifdef DIRTY_STRIPS
+    // Strips that have not changed since they were last sent are skipped
+    if (!field)
+    {
+        uint8_t strip = line / video.buffer_lines;
+        uint32_t hash = hashStrip(video.ptr_back_buffer, video.lineWords() * video.buffer_lines);
+        if (hash == strip_hash[strip]) return;
+        strip_hash[strip] = hash;
+    }
+    #endif
+
+    QueuedImage& image = image_queue[(queue_start + queue_count) % DISPLAY_BUFFERS];
+    image.pixels = video.ptr_back_buffer;
+    image.line = line;
+    image.field = field;
+    queue_count++;
+
+    while (queue_count + (sending ? 1 : 0) >= video.display_buffers) sendImage(true);
+    sendImage(false);
+    video.nextDisplayBuffer();
+#endif
+}
+
+#ifndef COMPOSITE_VIDEO
+// Starts sending the oldest queued buffer once the previous transfer is done. Without wait, gives
+// up and returns false while the DMA is still busy.
+IRAM_ATTR bool Bus::sendImage(bool wait)
+{
+    #ifndef DISABLE_DMA
+    if (sending)
+    {
+        if (!wait && ptr_screen->dmaBusy()) return false;
+        ptr_screen->dmaWait();
+        sending = nullptr;
+    }
+    #endif
+    if (queue_count == 0) return false;
+
+    Ppu2C02& video = ppu.display();
+    QueuedImage& image = image_queue[queue_start];
+    queue_start = (queue_start + 1) % DISPLAY_BUFFERS;
+    queue_count--;
+
+    #ifdef INTERLACED_RENDERING
+    if (image.field)
+    {
+        pushField(image);
+        return true;
+    }
+    #endif
+
+    // Move the window down to this strip if the screen expects another one
+    uint8_t line = image.line;
+    if (line != next_line)
+    {
+        ptr_screen->setAddrWindow(window_x, window_y + line, window_w, window_h - line);
+        window_line = line;
+    }
+    next_line = line + video.buffer_lines;
+    if (next_line >= window_h) next_line = window_line;
+
     #ifndef DISABLE_DMA
-    ptr_screen->pushPixelsDMA(ppu.ptr_display, 256 * SCANLINES_PER_BUFFER);
+    ptr_screen->pushPixelsDMA(image.pixels, video.lineWords() * video.buffer_lines);
+    sending = image.pixels;
     #else
-    ptr_screen->pushPixels(ppu.ptr_display, 256 * SCANLINES_PER_BUFFER);
+    ptr_screen->pushPixels(image.pixels, video.lineWords() * video.buffer_lines);
     #endif
+    return true;
+}
+
+// Sends everything still queued, so the whole frame is on screen before the next one starts
+void Bus::flushImages()
+{
+    while (sendImage(true));
+    #ifndef DISABLE_DMA
+    ptr_screen->dmaWait();
+    sending = nullptr;
+    #endif
+}
 #endif
+
+#if defined(INTERLACED_RENDERING) && !defined(COMPOSITE_VIDEO)
+// Sends the lines of one field, each to its own row since the other field's rows in between
+// are left as they are
+inline void Bus::pushField(const QueuedImage& image)
+{
+    Ppu2C02& video = ppu.display();
+    for (int i = 0; i < video.buffer_lines; i++)
+    {
+        uint8_t row = image.line + (i << 1);
+    #ifndef DISABLE_DMA
+        ptr_screen->dmaWait();
+        ptr_screen->setAddrWindow(window_x, window_y + row, window_w, 1);
+        ptr_screen->pushPixelsDMA(image.pixels + i * video.lineWords(), video.lineWords());
+    #else
+        ptr_screen->setAddrWindow(window_x, window_y + row, window_w, 1);
+        ptr_screen->pushPixels(image.pixels + i * video.lineWords(), video.lineWords());
+    #endif
+    }
+    #ifndef DISABLE_DMA
+    sending = image.pixels;
+    #endif
+
+    // The next whole strip has to set its own window
+    next_line = 0xFF;
+    #ifdef DIRTY_STRIPS
+    strip_hash[image.line / video.buffer_lines] = 0;
+    // The field's rows are every other line, so its last one is 2 * (buffer_lines - 1) further
+    strip_hash[(image.line + ((video.buffer_lines - 1) << 1)) / video.buffer_lines] = 0;
+    #endif
 }
+#endif
 
 IRAM_ATTR void Bus::IRQ()
 {
@@ -165,16 +552,24 @@ void Bus::saveState()
     File state = SD.open(filename, FILE_WRITE);
     if (!state) return;
 
-    // Header for verification - ANEMOIA + CRC32
-    state.print("ANEMOIA");
-    state.write((const uint8_t*)CRC32_str, 8);
+    size_t capacity = STATE_HEADER_SIZE + stateSize(true);
+    uint8_t* buffer = allocStateBuffer(capacity);
+    if (!buffer)
+    {
+        state.close();
+        return;
+    }
 
-    // Dump state
-    state.write(RAM, sizeof(RAM));
-    cpu.dumpState(state);
-    ppu.dumpState(state);
-    cart->dumpState(state);
+    {
+        FileStateStream stream(state, buffer, capacity);
 
+        // Header for verification - ANEMOIA + CRC32
+        stream.write((const uint8_t*)"ANEMOIA", 7);
+        stream.write((const uint8_t*)CRC32_str, 8);
+
+        dumpState(stream);
+    }
+    free(buffer);
     state.close();
 }
 
@@ -192,30 +587,63 @@ void Bus::loadState()
     File state = SD.open(filename, FILE_READ);
     if (!state) return;
 
+    size_t capacity = state.size();
+    uint8_t* buffer = allocStateBuffer(capacity);
+    if (!buffer)
+    {
+        state.close();
+        return;
+    }
+    FileStateStream stream(state, buffer, capacity);
+
     // Verify header
     static char header[8];
     static char CRC[9];
-    state.read((uint8_t*)&header, 7);
+    stream.read((uint8_t*)&header, 7);
     header[7] = '\0';
-    state.read((uint8_t*)&CRC, 8);
+    stream.read((uint8_t*)&CRC, 8);
     CRC[8] = '\0';
 
-    if (strcmp(header, "ANEMOIA") != 0)
-    {
-        state.close();
-        return;
-    }
-    if (strcmp(CRC, CRC32_str) != 0)
-    {
-        state.close();
-        return;
-    }
+    if (strcmp(header, "ANEMOIA") == 0 && strcmp(CRC, CRC32_str) == 0) loadState(stream);
+
+    free(buffer);
+    state.close();
+}
+
+// Allocates a buffer for a whole save state, or a smaller one if the heap is short
+uint8_t* Bus::allocStateBuffer(size_t& capacity)
+{
+    uint8_t* buffer = (uint8_t*)malloc(capacity);
+    if (buffer) return buffer;
+
+    LOGF("Not enough memory to buffer a %u byte state\n", capacity);
+    capacity = STATE_MIN_BUFFER_SIZE;
+    return (uint8_t*)malloc(capacity);
+}
+
+// Exact size of dumpState() output, found by a dry run. Files carry a few more bytes than
+// snapshots in RAM.
+size_t Bus::stateSize(bool persistent)
+{
+    CountingStateStream counter(persistent);
+    dumpState(counter);
+    if (!persistent && counter.count > STATE_MAX_SIZE)
+        LOGF("State of %u bytes is over STATE_MAX_SIZE\n", counter.count);
+    return counter.count;
+}
 
-    // Load state
+void Bus::dumpState(StateStream& state)
+{
+    state.write(RAM, sizeof(RAM));
+    cpu.dumpState(state);
+    ppu.dumpState(state);
+    cart->dumpState(state);
+}
+
+void Bus::loadState(StateStream& state)
+{
     state.read(RAM, sizeof(RAM));
     cpu.loadState(state);
     ppu.loadState(state);
     cart->loadState(state);
-
-    state.close();
 }
@@ -6,11 +6,43 @@
 #include "config.h"
 #include "cpu6502.h"
 #include "ppu2C02.h"
+#ifdef REWIND
+    #include "rewind.h"
+#endif
 #include <Arduino.h>
 #include <TFT_eSPI.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef FRAMESKIP
+    #ifndef MAX_FRAMESKIP
+        #define MAX_FRAMESKIP 3 // Most frames skipped in a row
+    #endif
+    #define FRAMESKIP_BUDGET 16639 // Frame time in µs at 60.098 FPS
+    #define FRAMESKIP_HOLD   60    // Frames with headroom before skipping less
+#endif
+
+#ifdef RUN_AHEAD
+    #define RUN_AHEAD_BUDGET    16639 // Frame time in µs at 60.098 FPS
+    #define RUN_AHEAD_RETRY     600   // Normal frames before trying to run ahead again
+    #define RUN_AHEAD_MAX       2     // Most frames that can be run ahead
+    // Heap taken by the state saved before running ahead
+    #define RUN_AHEAD_HEAP_SIZE STATE_MAX_SIZE
+#endif
+
+#ifdef DIRTY_STRIPS
+    #define STRIP_COUNT (240 / (SCANLINES_PER_BUFFER >> 1)) // Enough for half size buffers
+#endif
+
+#define STATE_HEADER_SIZE     15  // "ANEMOIA" + CRC32 in hex
+#define STATE_MIN_BUFFER_SIZE 512 // Buffer for save states when the whole state does not fit
+
+#ifdef FAST_FORWARD
+    #ifndef FAST_FORWARD_SPEED
+        #define FAST_FORWARD_SPEED 4 // Frames run per drawn frame while fast-forwarding
+    #endif
+#endif
+
 class Bus
 {
 public:
@@ -31,20 +63,108 @@ public:
 
     void insertCartridge(Cartridge* cartridge);
     void connectScreen(TFT_eSPI* screen);
+    void setScreenWindow(int32_t x, int32_t y, int32_t w, int32_t h);
+#ifdef RGB444_OUTPUT
+    void setScreenRGB444(bool enable);
+#endif
     void connectFramebuffer(uint8_t* framebuffer);
     void reset();
     void clock();
+#ifdef COMPOSITE_VIDEO
+    void skipFrame();
+    bool frame_drawn = false; // Whether the last frame run was drawn
+#endif
     void IRQ();
     void NMI();
     void OAM_Write(uint8_t addr, uint8_t data);
     void renderImage(uint16_t scanline);
+#ifndef COMPOSITE_VIDEO
+    // Starts the next queued display buffer if the DMA is free
+    void pumpImages()
+    {
+        if (queue_count) sendImage(false);
+    }
+#endif
 
     void saveState();
     void loadState();
+    void dumpState(StateStream& state);
+    void loadState(StateStream& state);
+    size_t stateSize(bool persistent = false);
+#ifdef REWIND
+    Rewind rewind;
+#endif
+
+#ifdef FRAMESKIP
+    uint8_t frameskip = 0;       // Frames currently skipped after each rendered frame
+    uint32_t skipped_frames = 0; // Total skipped frames, for stats
+#endif
+#ifdef FAST_FORWARD
+    bool fast_forward = false;
+    void setFastForward(bool enable);
+#endif
+#ifdef RUN_AHEAD
+    uint8_t run_ahead = 0; // Frames to run ahead, set per game
+#endif
 
 private:
+    uint8_t* allocStateBuffer(size_t& capacity);
+    void runFrame(bool frame_latch);
     void cpuClock();
+    void clockScanline(int cycles);
+#ifdef FRAMESKIP
+    uint8_t skip_counter = 0;
+    uint8_t frameskip_hold = 0;
+    uint32_t render_cost = 0; // Average frame times in µs
+    uint32_t skip_cost = 0;
+    void updateFrameskip(bool skipped, uint32_t elapsed);
+#endif
+#ifdef FAST_FORWARD
+    uint8_t fast_forward_counter = 0;
+#endif
+#ifdef RUN_AHEAD
+    uint8_t* run_ahead_state = nullptr;
+    size_t run_ahead_size = 0;
+    uint32_t run_ahead_cost = 0; // Average time in µs of a run-ahead frame
+    uint16_t run_ahead_retry = 0;
+    bool runAhead();
+#endif
+#ifndef COMPOSITE_VIDEO
+    // Display buffers waiting to be sent, oldest first
+    struct QueuedImage
+    {
+        uint16_t* pixels;
+        uint8_t line; // Row in the screen window
+        bool field;   // Holds every other line
+    };
+    QueuedImage image_queue[DISPLAY_BUFFERS];
+    uint8_t queue_start = 0;
+    uint8_t queue_count = 0;
+    uint16_t* sending = nullptr; // Buffer the DMA may still be reading
+    bool sendImage(bool wait);
+    void flushImages();
+#endif
+#ifdef INTERLACED_RENDERING
+    #ifdef FRAMESKIP
+    uint8_t field_parity = 0;
+    bool runField(uint64_t frame_start);
+    #endif
+    #ifndef COMPOSITE_VIDEO
+    void pushField(const QueuedImage& image);
+    #endif
+#endif
     TFT_eSPI* ptr_screen;
+    int16_t window_x = 0;
+    int16_t window_y = 0;
+    int16_t window_w = 0;
+    int16_t window_h = 0;
+#ifdef DIRTY_STRIPS
+    uint32_t strip_hash[STRIP_COUNT]; // Hash of each strip as last sent
+#endif
+    // Row the screen writes to next, and the top row of the address window that it wraps
+    // back to after the last row
+    uint8_t next_line = 0;
+    uint8_t window_line = 0;
     uint8_t controller_state;
     uint8_t controller_strobe = 0x00;
 };
@@ -182,6 +182,15 @@ IRAM_ATTR void Cartridge::loadCHRBank(uint8_t* bank, uint16_t size, uint32_t off
 {
     rom.seek(chr_base + offset);
     rom.read(bank, size);
+    invalidateCHRCache();
+}
+
+// Called whenever CHR memory behind a pointer gets new contents
+IRAM_ATTR void Cartridge::invalidateCHRCache()
+{
+#ifdef CHR_TILE_CACHE
+    Ppu2C02::invalidateCHRCache();
+#endif
 }
 
 IRAM_ATTR void Cartridge::setMirrorMode(MIRROR mirror)
@@ -199,7 +208,7 @@ void Cartridge::IRQ()
     bus->IRQ();
 }
 
-void Cartridge::dumpState(File& state)
+void Cartridge::dumpState(StateStream& state)
 {
     // mapper.vtable->dumpState(&mapper, state);
     switch (mapper_ID)
@@ -214,7 +223,7 @@ void Cartridge::dumpState(File& state)
     }
 }
 
-void Cartridge::loadState(File& state)
+void Cartridge::loadState(StateStream& state)
 {
     // mapper.vtable->loadState(&mapper, state);
     switch (mapper_ID)
@@ -234,6 +243,11 @@ bool Cartridge::isValid()
     return is_valid;
 }
 
+bool Cartridge::outOfMemory()
+{
+    return out_of_memory;
+}
+
 void Cartridge::seek(uint32_t offset)
 {
     rom.seek(offset);
@@ -256,6 +270,14 @@ void Cartridge::createMapper(uint8_t number_PRG_banks, uint8_t number_CHR_banks,
     case 69: mapper = createMapper069(number_PRG_banks, number_CHR_banks, backend, this); break;
     default: is_valid = false; break;
     }
+
+    // Mappers return no state when their memory could not be allocated
+    if (is_valid && !mapper.state)
+    {
+        LOG("Not enough memory to load the ROM");
+        is_valid = false;
+        out_of_memory = true;
+    }
 }
 
 uint32_t Cartridge::crc32(const void* buf, size_t size, uint32_t seed)
@@ -42,6 +42,7 @@ public:
 
     void loadPRGBank(uint8_t* bank, uint16_t size, uint32_t offset);
     void loadCHRBank(uint8_t* bank, uint16_t size, uint32_t offset);
+    void invalidateCHRCache();
     void setMirrorMode(MIRROR mirror);
     Cartridge::MIRROR getMirrorMode();
     void connectBus(Bus* n)
@@ -50,9 +51,10 @@ public:
     }
     void IRQ();
 
-    void dumpState(File& state);
-    void loadState(File& state);
+    void dumpState(StateStream& state);
+    void loadState(StateStream& state);
     bool isValid();
+    bool outOfMemory();
 
     void seek(uint32_t offset);
     void read(uint8_t* buf, size_t size);
@@ -65,6 +67,7 @@ public:
 private:
     Bus* bus = nullptr;
     bool is_valid = true;
+    bool out_of_memory = false;
     uint32_t prg_base;
     uint32_t chr_base;
 
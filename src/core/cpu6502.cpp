@@ -54,6 +54,10 @@ IRAM_ATTR void Cpu6502::clock(int i)
 
         opcode = read(PC++);
         cycles = instr_cycles[opcode];
+#ifdef MID_SCANLINE_RENDERING
+        // Register writes land at the end of the instruction
+        batch_cycle = batch_offset + i - remaining_cycles + cycles;
+#endif
         switch (opcode)
         {
         case 0x00: EXECUTE(IMM, Instr_BRK); break;
@@ -371,6 +375,9 @@ void Cpu6502::reset()
 
 IRAM_ATTR void Cpu6502::apuWrite(uint16_t addr, uint8_t data)
 {
+#ifdef RUN_AHEAD
+    if (mute_apu) return;
+#endif
     apu.cpuWrite(addr, data);
 }
 
@@ -1031,7 +1038,7 @@ void Cpu6502::NMI()
     cycles += 8;
 }
 
-void Cpu6502::dumpState(File& state)
+void Cpu6502::dumpState(StateStream& state)
 {
     state.write((uint8_t*)&A, sizeof(A));
     state.write((uint8_t*)&X, sizeof(X));
@@ -1049,7 +1056,7 @@ void Cpu6502::dumpState(File& state)
     state.write((uint8_t*)&OAM_DMA_page, sizeof(OAM_DMA_page));
 }
 
-void Cpu6502::loadState(File& state)
+void Cpu6502::loadState(StateStream& state)
 {
     state.read((uint8_t*)&A, sizeof(A));
     state.read((uint8_t*)&X, sizeof(X));
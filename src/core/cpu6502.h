@@ -44,8 +44,8 @@ public:
     void IRQ();
     void NMI();
 
-    void dumpState(File& state);
-    void loadState(File& state);
+    void dumpState(StateStream& state);
+    void loadState(StateStream& state);
 
     void connectBus(Bus* n)
     {
@@ -68,6 +68,13 @@ public:
     uint16_t addr_abs = 0x0000;
     uint16_t addr_rel = 0x0000;
     int cycles = 0;
+#ifdef RUN_AHEAD
+    bool mute_apu = false; // Drops APU writes from frames that will be rolled back
+#endif
+#ifdef MID_SCANLINE_RENDERING
+    uint8_t batch_cycle = 0;  // CPU cycle within the current scanline
+    uint8_t batch_offset = 0; // Cycles already run on this scanline before this clock() call
+#endif
 
 private:
     Cartridge* __restrict cart = nullptr;
@@ -1,61 +1,171 @@
 #include "mapper.h"
+#include "bus.h"
 #include "cartridge.h"
 
-void bankInit(BankCache* cache, Bank* banks, uint8_t num_banks, uint32_t bank_size, Cartridge* cart)
+// Slots needed to hold the whole ROM
+static uint16_t fullSlots(const BankCachePlan& plan)
 {
-    cache->banks = banks;
-    cache->num_banks = num_banks;
-    cache->tick = 0;
+    if (plan.rom_banks == 0) return 1;
+    return (plan.rom_banks > BANK_CACHE_MAX_SLOTS) ? BANK_CACHE_MAX_SLOTS : plan.rom_banks;
+}
+
+// Sizes the caches from the heap left at load. Each gets its minimum first, then the rest of the
+// budget, at most extra_limit bytes, is shared by how much of each ROM would still be missing, so
+// small ROMs become fully resident and large ones get as many banks as the board can spare.
+// Returns the bytes planned beyond the minimums.
+static uint32_t planBankCaches(BankCachePlan* plans, uint8_t count, uint32_t extra_limit)
+{
+    uint32_t reserve = BANK_CACHE_HEAP_RESERVE;
+#ifdef REWIND
+    reserve += REWIND_HEAP_SIZE;
+#endif
+#ifdef RUN_AHEAD
+    reserve += RUN_AHEAD_HEAP_SIZE;
+#endif
+    size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    uint32_t budget = (free_heap > reserve) ? free_heap - reserve : 0;
+    LOGF("Bank caches: %lu KB budget, largest free block %u KB\n", (unsigned long)(budget / 1024),
+         heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 1024);
+
+    uint32_t missing_total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        BankCachePlan& plan = plans[i];
+        uint16_t full = fullSlots(plan);
+        plan.slots = (plan.min_slots < full) ? plan.min_slots : full;
+
+        uint32_t size = plan.slots * plan.bank_size;
+        budget = (budget > size) ? budget - size : 0;
+        missing_total += (full - plan.slots) * plan.bank_size;
+    }
+    if (budget > extra_limit) budget = extra_limit;
+
+    uint32_t extra = 0;
+    for (int i = 0; i < count; i++)
+    {
+        BankCachePlan& plan = plans[i];
+        uint16_t full = fullSlots(plan);
+        if (full > plan.slots)
+        {
+            uint32_t missing = (full - plan.slots) * plan.bank_size;
+            uint32_t share = missing;
+            if (missing_total > budget) share = (uint64_t)budget * missing / missing_total;
+            plan.slots += share / plan.bank_size;
+            extra += (share / plan.bank_size) * plan.bank_size;
+        }
+        LOGF("Bank cache: %u of %u %lu KB banks\n", plan.slots, plan.rom_banks,
+             (unsigned long)(plan.bank_size / 1024));
+    }
+    return extra;
+}
+
+// Plans and allocates all the caches of a mapper. The free total overstates what fits on a
+// fragmented heap, where the banks of the first caches can take the blocks a later one needs for
+// its minimum. If that happens everything is freed and planned again with half the extra banks,
+// until only the minimums are left.
+bool bankInitAll(BankCache* const* caches, BankCachePlan* plans, uint8_t count, Cartridge* cart)
+{
+    uint32_t extra_limit = UINT32_MAX;
+    for (;;)
+    {
+        uint32_t extra = planBankCaches(plans, count, extra_limit);
+        int ready = 0;
+        while (ready < count && bankInit(caches[ready], plans[ready], cart)) ready++;
+        if (ready == count) return true;
+
+        for (int i = 0; i < ready; i++) bankFree(caches[i]);
+        if (extra == 0) return false;
+        extra_limit = extra / 2;
+        LOGF("Bank caches: replanning with %lu KB of extra banks\n",
+             (unsigned long)(extra_limit / 1024));
+    }
+}
+
+// Allocates up to plan.slots banks, keeping however many fit if the heap runs out. Fails if that
+// is fewer than the mapper needs, which would evict banks still switched in.
+bool bankInit(BankCache* cache, const BankCachePlan& plan, Cartridge* cart)
+{
+    uint8_t num_banks = plan.slots;
+    uint32_t bank_size = plan.bank_size;
+    cache->banks = (Bank*)malloc(num_banks * sizeof(Bank));
+    cache->num_banks = 0;
+    cache->hand = 0;
     cache->cart = cart;
+    memset(cache->slot_of, BANK_SLOT_EMPTY, sizeof(cache->slot_of));
+    if (!cache->banks)
+    {
+        LOG("Bank cache allocation failed.");
+        return false;
+    }
 
     for (int i = 0; i < num_banks; i++)
     {
-        cache->banks[i].bank_id = 0xFF;
-        cache->banks[i].last_used = 0;
-        cache->banks[i].size = bank_size;
-
         uint8_t* ptr = (uint8_t*)malloc(bank_size);
-        if (!ptr) LOGF("%lu KB for bank %d Allocation failed.\n", bank_size / 1024, i);
-        else
+        if (!ptr)
         {
-            LOGF("Allocated %lu KB for bank %d, free heap: %u bytes\n", bank_size / 1024, i,
-                 heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+            LOGF("%lu KB for bank %d Allocation failed.\n", bank_size / 1024, i);
+            break;
         }
+        LOGF("Allocated %lu KB for bank %d, free heap: %u bytes\n", bank_size / 1024, i,
+             heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+
+        cache->banks[i].bank_id = 0xFF;
+        cache->banks[i].referenced = false;
         cache->banks[i].bank_ptr = ptr;
+        cache->banks[i].size = bank_size;
+        cache->num_banks++;
+    }
+
+    uint8_t needed = (plan.min_slots < num_banks) ? plan.min_slots : num_banks;
+    if (cache->num_banks < needed)
+    {
+        LOGF("Bank cache: %u banks allocated, %u needed\n", cache->num_banks, needed);
+        bankFree(cache);
+        return false;
     }
+    return true;
 }
 
-IRAM_ATTR uint8_t* getBank(BankCache* cache, uint8_t bank_id, RomType rom)
+void bankFree(BankCache* cache)
 {
-    cache->tick++;
+    if (!cache->banks) return;
+    for (int i = 0, n = cache->num_banks; i < n; i++) free(cache->banks[i].bank_ptr);
+    free(cache->banks);
+    cache->banks = nullptr;
+    cache->num_banks = 0;
+}
 
-    for (int i = 0, n = cache->num_banks; i < n; i++)
+IRAM_ATTR uint8_t* getBank(BankCache* cache, uint8_t bank_id, RomType rom)
+{
+    uint8_t slot = cache->slot_of[bank_id];
+    if (slot != BANK_SLOT_EMPTY)
     {
-        if (cache->banks[i].bank_id == bank_id)
-        {
-            cache->banks[i].last_used = cache->tick;
-            return cache->banks[i].bank_ptr;
-        }
+        cache->banks[slot].referenced = true;
+        return cache->banks[slot].bank_ptr;
     }
 
-    int bank_index = 0;
-    uint32_t min_use = cache->banks[0].last_used;
-    for (int i = 1, n = cache->num_banks; i < n; i++)
+    // Advance the hand past recently used banks, clearing their flag as it goes
+    Bank* victim;
+    for (;;)
     {
-        if (cache->banks[i].last_used < min_use)
-        {
-            min_use = cache->banks[i].last_used;
-            bank_index = i;
-        }
+        victim = &cache->banks[cache->hand];
+        slot = cache->hand;
+        if (++cache->hand == cache->num_banks) cache->hand = 0;
+        if (!victim->referenced) break;
+        victim->referenced = false;
     }
 
-    uint8_t* bank = cache->banks[bank_index].bank_ptr;
-    uint32_t size = cache->banks[bank_index].size;
+    // Bank 0xFF is a valid id, so only unmap the old bank if this slot really held it
+    if (cache->slot_of[victim->bank_id] == slot) cache->slot_of[victim->bank_id] = BANK_SLOT_EMPTY;
+
+    uint8_t* bank = victim->bank_ptr;
+    uint32_t size = victim->size;
     if (rom == RomType::PRG) cache->cart->loadPRGBank(bank, size, bank_id * size);
     else if (rom == RomType::CHR) cache->cart->loadCHRBank(bank, size, bank_id * size);
 
-    cache->banks[bank_index].bank_id = bank_id;
-    cache->banks[bank_index].last_used = cache->tick;
+    victim->bank_id = bank_id;
+    victim->referenced = true;
+    cache->slot_of[bank_id] = slot;
 
     return bank;
 }
@@ -74,10 +184,11 @@ void invalidateCache(BankCache* cache)
 {
     if (!cache || !cache->banks) return;
 
-    cache->tick = 0;
+    cache->hand = 0;
+    memset(cache->slot_of, BANK_SLOT_EMPTY, sizeof(cache->slot_of));
     for (int i = 0, n = cache->num_banks; i < n; i++)
     {
         cache->banks[i].bank_id = 0xFF;
-        cache->banks[i].last_used = 0;
+        cache->banks[i].referenced = false;
     }
 }
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include "config.h"
 #include "rom_backends.h"
 #include "rom_types.h"
+#include "state_stream.h"
 
 class Cartridge;
 class Mapper
@@ -27,24 +28,45 @@ inline void mapperNoCycle(Mapper*, int)
 {
 }
 
+#define BANK_SLOT_EMPTY      0xFF
+#define BANK_CACHE_MAX_SLOTS 255 // Slot 0xFF would read as empty
+
+// Heap left free after sizing the bank caches, for the display ring, tasks and save states
+#ifndef BANK_CACHE_HEAP_RESERVE
+    #define BANK_CACHE_HEAP_RESERVE (64U * 1024U)
+#endif
+
 struct Bank
 {
     uint8_t bank_id;
+    bool referenced; // Used since the clock hand last passed
     uint8_t* bank_ptr;
-    uint32_t last_used;
     uint32_t size;
 };
 
+// Banks are found through slot_of, indexed by bank number. On a miss the clock hand sweeps the
+// slots, giving each recently used bank a second chance before evicting it.
 struct BankCache
 {
-    Bank* banks;
-    uint8_t num_banks;
-    uint32_t tick;
-    Cartridge* cart;
+    Bank* banks = nullptr;
+    uint8_t num_banks = 0;
+    uint8_t hand = 0;
+    Cartridge* cart = nullptr;
+    uint8_t slot_of[256]; // Slot holding each bank, BANK_SLOT_EMPTY if not loaded
+};
+
+// One cache to size at cartridge load, slots is filled in by bankInitAll()
+struct BankCachePlan
+{
+    uint16_t rom_banks; // Banks of bank_size in the ROM
+    uint32_t bank_size;
+    uint8_t min_slots; // Enough for every bank the mapper can have switched in at once
+    uint8_t slots;
 };
 
-void bankInit(BankCache* cache, Bank* banks, uint8_t num_banks, uint32_t bank_size,
-              Cartridge* cart);
+bool bankInitAll(BankCache* const* caches, BankCachePlan* plans, uint8_t count, Cartridge* cart);
+bool bankInit(BankCache* cache, const BankCachePlan& plan, Cartridge* cart);
+void bankFree(BankCache* cache);
 uint8_t* getBank(BankCache* cache, uint8_t bank_id, RomType rom);
 uint8_t getBankIndex(BankCache* cache, uint8_t* ptr);
 void invalidateCache(BankCache* cache);
@@ -76,17 +76,21 @@ void mapper000_reset(Mapper* mapper)
     }
 }
 
-void mapper000_dumpState(Mapper* mapper, File& state)
+void mapper000_dumpState(Mapper* mapper, StateStream& state)
 {
     Mapper000_state* s = (Mapper000_state*)mapper->state;
     if (s->number_CHR_banks == 0 && s->CHR_bank) state.write(s->CHR_bank, 8U * 1024U);
     return;
 }
 
-void mapper000_loadState(Mapper* mapper, File& state)
+void mapper000_loadState(Mapper* mapper, StateStream& state)
 {
     Mapper000_state* s = (Mapper000_state*)mapper->state;
-    if (s->number_CHR_banks == 0 && s->CHR_bank) state.read(s->CHR_bank, 8U * 1024U);
+    if (s->number_CHR_banks == 0 && s->CHR_bank)
+    {
+        state.read(s->CHR_bank, 8U * 1024U);
+        s->cart->invalidateCHRCache();
+    }
     return;
 }
 
@@ -24,6 +24,6 @@ bool mapper000_ppuRead(Mapper* mapper, uint16_t addr, uint8_t& data);
 bool mapper000_ppuWrite(Mapper* mapper, uint16_t addr, uint8_t data);
 uint8_t* mapper000_ppuReadPtr(Mapper* mapper, uint16_t addr);
 void mapper000_reset(Mapper* mapper);
-void mapper000_dumpState(Mapper* mapper, File& state);
-void mapper000_loadState(Mapper* mapper, File& state);
+void mapper000_dumpState(Mapper* mapper, StateStream& state);
+void mapper000_loadState(Mapper* mapper, StateStream& state);
 #endif
@@ -15,9 +15,6 @@ struct Mapper001_state
     uint8_t* ptr_8K_CHR_bank;
     uint8_t* ptr_4K_CHR_banks[2];
 
-    Bank PRG_banks_16K[MAPPER001_NUM_PRG_BANKS_16K];
-    Bank CHR_banks_8K[MAPPER001_NUM_CHR_BANKS_8K];
-    Bank CHR_banks_4K[MAPPER001_NUM_CHR_BANKS_4K];
     BankCache PRG_16K_cache;
     BankCache CHR_8K_cache;
     BankCache CHR_4K_cache;
@@ -269,7 +266,7 @@ void mapper001_reset(Mapper* mapper)
     state->cart->setMirrorMode(Cartridge::MIRROR::HORIZONTAL);
 }
 
-void mapper001_dumpState(Mapper* mapper, File& state)
+void mapper001_dumpState(Mapper* mapper, StateStream& state)
 {
     Mapper001_state* s = (Mapper001_state*)mapper->state;
     Cartridge::MIRROR mirror = s->cart->getMirrorMode();
@@ -326,7 +323,7 @@ void mapper001_dumpState(Mapper* mapper, File& state)
     }
 }
 
-void mapper001_loadState(Mapper* mapper, File& state)
+void mapper001_loadState(Mapper* mapper, StateStream& state)
 {
     Mapper001_state* s = (Mapper001_state*)mapper->state;
     Cartridge::MIRROR mirror;
@@ -349,17 +346,18 @@ void mapper001_loadState(Mapper* mapper, File& state)
     {
     case ROMBackend::LRU:
         state.read(PRG_16K, sizeof(PRG_16K));
-        invalidateCache(&s->PRG_16K_cache);
         for (int i = 0; i < 4; i++)
             s->ptr_16K_PRG_banks[i] = getBank(&s->PRG_16K_cache, PRG_16K[i], RomType::PRG);
-        if (s->number_CHR_banks == 0) { state.read(s->CHR_RAM, 8U * 1024U); }
+        if (s->number_CHR_banks == 0)
+        {
+            state.read(s->CHR_RAM, 8U * 1024U);
+            s->cart->invalidateCHRCache();
+        }
         else
         {
             state.read((uint8_t*)&CHR_8K, sizeof(CHR_8K));
             state.read(CHR_4K, sizeof(CHR_4K));
 
-            invalidateCache(&s->CHR_8K_cache);
-            invalidateCache(&s->CHR_4K_cache);
             s->ptr_8K_CHR_bank = getBank(&s->CHR_8K_cache, CHR_8K, RomType::CHR);
             for (int i = 0; i < 2; i++)
                 s->ptr_4K_CHR_banks[i] = getBank(&s->CHR_4K_cache, CHR_4K[i], RomType::CHR);
@@ -374,7 +372,11 @@ void mapper001_loadState(Mapper* mapper, File& state)
                 (uint8_t*)(s->mROM->prg_base + (uint32_t)PRG_16K[i] * (16U * 1024U));
         }
 
-        if (s->number_CHR_banks == 0) { state.read(s->CHR_RAM, (8U * 1024U)); }
+        if (s->number_CHR_banks == 0)
+        {
+            state.read(s->CHR_RAM, 8U * 1024U);
+            s->cart->invalidateCHRCache();
+        }
         else
         {
             state.read((uint8_t*)&CHR_8K, sizeof(CHR_8K));
@@ -396,23 +398,39 @@ Mapper createMapper001(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend,
     switch (backend)
     {
     case ROMBackend::LRU:
-        bankInit(&state->PRG_16K_cache, state->PRG_banks_16K, MAPPER001_NUM_PRG_BANKS_16K,
-                 16U * 1024U, cart);
-
+    {
+        bool cached;
         if (CHR_banks == 0)
         {
             // Allocate one shared 8 KB RAM
             state->CHR_RAM = (uint8_t*)malloc(8U * 1024U);
             memset(state->CHR_RAM, 0, 8U * 1024U);
+
+            BankCache* caches[1] = { &state->PRG_16K_cache };
+            BankCachePlan plan = { PRG_banks, 16U * 1024U, MAPPER001_MIN_PRG_BANKS_16K, 0 };
+            cached = bankInitAll(caches, &plan, 1, cart);
         }
         else
         {
-            bankInit(&state->CHR_8K_cache, state->CHR_banks_8K, MAPPER001_NUM_CHR_BANKS_8K,
-                     8U * 1024U, cart);
-            bankInit(&state->CHR_4K_cache, state->CHR_banks_4K, MAPPER001_NUM_CHR_BANKS_4K,
-                     4U * 1024, cart);
+            BankCache* caches[3] = { &state->PRG_16K_cache, &state->CHR_8K_cache,
+                                     &state->CHR_4K_cache };
+            BankCachePlan plans[3] = {
+                { PRG_banks, 16U * 1024U, MAPPER001_MIN_PRG_BANKS_16K, 0 },
+                { CHR_banks, 8U * 1024U, MAPPER001_MIN_CHR_BANKS_8K, 0 },
+                { (uint16_t)(CHR_banks * 2), 4U * 1024U, MAPPER001_MIN_CHR_BANKS_4K, 0 },
+            };
+            cached = bankInitAll(caches, plans, 3, cart);
+        }
+
+        // Without state the cartridge reports the ROM as not loadable
+        if (!cached)
+        {
+            free(state->CHR_RAM);
+            delete state;
+            return mapper;
         }
         break;
+    }
     case ROMBackend::FLASH:
         state->mROM = &cart->mROM;
         if (CHR_banks == 0)
@@ -458,6 +476,9 @@ static inline uint8_t* getCHRBank4K(Mapper001_state* state, uint8_t index)
 static inline void loadCHRRAM(Mapper001_state* state, uint8_t* bank, uint16_t size, uint32_t offset)
 {
     if (state->backend == ROMBackend::FLASH)
+    {
         memcpy(bank, (uint8_t*)(state->mROM->chr_base + offset), size);
+        state->cart->invalidateCHRCache();
+    }
     else state->cart->loadCHRBank(bank, size, offset);
 }
@@ -80,7 +80,7 @@ void mapper002_reset(Mapper* mapper)
     }
 }
 
-void mapper002_dumpState(Mapper* mapper, File& state)
+void mapper002_dumpState(Mapper* mapper, StateStream& state)
 {
     Mapper002_state* s = (Mapper002_state*)mapper->state;
     uint8_t PRG_16K;
@@ -100,7 +100,7 @@ void mapper002_dumpState(Mapper* mapper, File& state)
     }
 }
 
-void mapper002_loadState(Mapper* mapper, File& state)
+void mapper002_loadState(Mapper* mapper, StateStream& state)
 {
     Mapper002_state* s = (Mapper002_state*)mapper->state;
     uint8_t PRG_16K;
@@ -108,15 +108,22 @@ void mapper002_loadState(Mapper* mapper, File& state)
     {
     case ROMBackend::LRU:
         state.read((uint8_t*)&PRG_16K, sizeof(PRG_16K));
-        invalidateCache(&s->prg_cache);
         s->ptr_16K_PRG_banks[0] = getBank(&s->prg_cache, PRG_16K, RomType::PRG);
-        if (s->number_CHR_banks == 0) { state.read(s->CHR_bank, 8U * 1024U); }
+        if (s->number_CHR_banks == 0)
+        {
+            state.read(s->CHR_bank, 8U * 1024U);
+            s->cart->invalidateCHRCache();
+        }
         return;
 
     case ROMBackend::FLASH:
         state.read((uint8_t*)&PRG_16K, sizeof(PRG_16K));
         s->ptr_16K_PRG_banks[0] = (uint8_t*)(s->mROM->prg_base + (PRG_16K * (16U * 1024U)));
-        if (s->number_CHR_banks == 0) { state.read(s->CHR_bank, 8U * 1024U); }
+        if (s->number_CHR_banks == 0)
+        {
+            state.read(s->CHR_bank, 8U * 1024U);
+            s->cart->invalidateCHRCache();
+        }
         return;
     }
 }
@@ -128,11 +135,21 @@ Mapper createMapper002(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend,
     switch (backend)
     {
     case ROMBackend::LRU:
+    {
         state->PRG_bank = (uint8_t*)malloc(16U * 1024U);
         state->CHR_bank = (uint8_t*)malloc(8U * 1024U);
-        bankInit(&state->prg_cache, state->prg_banks, MAPPER002_NUM_PRG_BANKS_16K, 16U * 1024U,
-                 cart);
+
+        BankCachePlan plan = { PRG_banks, 16U * 1024U, MAPPER002_MIN_PRG_BANKS_16K, 0 };
+        BankCache* caches[1] = { &state->prg_cache };
+        if (!bankInitAll(caches, &plan, 1, cart))
+        {
+            free(state->PRG_bank);
+            free(state->CHR_bank);
+            delete state;
+            return mapper;
+        }
         break;
+    }
 
     case ROMBackend::FLASH:
         if (CHR_banks == 0) state->CHR_bank = (uint8_t*)malloc(8U * 1024U);
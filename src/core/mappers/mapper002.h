@@ -3,7 +3,7 @@
 
 #include "../mapper.h"
 
-#define MAPPER002_NUM_PRG_BANKS_16K 7
+#define MAPPER002_MIN_PRG_BANKS_16K 2
 struct Mapper002_state
 {
     Cartridge* cart = nullptr;
@@ -12,7 +12,6 @@ struct Mapper002_state
     uint8_t number_PRG_banks;
     uint8_t number_CHR_banks;
     uint8_t* ptr_16K_PRG_banks[2];
-    Bank prg_banks[MAPPER002_NUM_PRG_BANKS_16K];
     BankCache prg_cache;
     uint8_t* PRG_bank = nullptr;
     uint8_t* CHR_bank = nullptr;
@@ -26,6 +25,6 @@ bool mapper002_ppuRead(Mapper* mapper, uint16_t addr, uint8_t& data);
 bool mapper002_ppuWrite(Mapper* mapper, uint16_t addr, uint8_t data);
 uint8_t* mapper002_ppuReadPtr(Mapper* mapper, uint16_t addr);
 void mapper002_reset(Mapper* mapper);
-void mapper002_dumpState(Mapper* mapper, File& state);
-void mapper002_loadState(Mapper* mapper, File& state);
+void mapper002_dumpState(Mapper* mapper, StateStream& state);
+void mapper002_loadState(Mapper* mapper, StateStream& state);
 #endif
\ No newline at end of file
@@ -61,7 +61,7 @@ void mapper003_reset(Mapper* mapper)
     }
 }
 
-void mapper003_dumpState(Mapper* mapper, File& state)
+void mapper003_dumpState(Mapper* mapper, StateStream& state)
 {
     Mapper003_state* s = (Mapper003_state*)mapper->state;
     uint8_t CHR_bank;
@@ -78,7 +78,7 @@ void mapper003_dumpState(Mapper* mapper, File& state)
     }
 }
 
-void mapper003_loadState(Mapper* mapper, File& state)
+void mapper003_loadState(Mapper* mapper, StateStream& state)
 {
     Mapper003_state* s = (Mapper003_state*)mapper->state;
     uint8_t CHR_bank;
@@ -86,7 +86,6 @@ void mapper003_loadState(Mapper* mapper, File& state)
     {
     case ROMBackend::LRU:
         state.read((uint8_t*)&CHR_bank, sizeof(CHR_bank));
-        invalidateCache(&s->CHR_cache_8K);
         s->ptr_CHR_bank_8K = getBank(&s->CHR_cache_8K, CHR_bank, RomType::CHR);
         return;
 
@@ -104,10 +103,19 @@ Mapper createMapper003(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend,
     switch (backend)
     {
     case ROMBackend::LRU:
+    {
         state->PRG_bank = (uint8_t*)malloc(32U * 1024U);
-        bankInit(&state->CHR_cache_8K, state->CHR_banks_8K, MAPPER003_NUM_CHR_BANKS_8K, 8U * 1024U,
-                 cart);
+
+        BankCachePlan plan = { CHR_banks, 8U * 1024U, MAPPER003_MIN_CHR_BANKS_8K, 0 };
+        BankCache* caches[1] = { &state->CHR_cache_8K };
+        if (!bankInitAll(caches, &plan, 1, cart))
+        {
+            free(state->PRG_bank);
+            delete state;
+            return mapper;
+        }
         break;
+    }
 
     case ROMBackend::FLASH: state->mROM = &cart->mROM; break;
     }
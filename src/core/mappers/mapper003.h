@@ -3,7 +3,7 @@
 
 #include "../mapper.h"
 
-#define MAPPER003_NUM_CHR_BANKS_8K 16
+#define MAPPER003_MIN_CHR_BANKS_8K 2
 struct Mapper003_state
 {
     Cartridge* cart = nullptr;
@@ -13,7 +13,6 @@ struct Mapper003_state
     uint8_t number_CHR_banks;
 
     uint8_t* ptr_CHR_bank_8K = nullptr;
-    Bank CHR_banks_8K[MAPPER003_NUM_CHR_BANKS_8K];
     BankCache CHR_cache_8K;
     uint8_t* PRG_bank = nullptr;
 };
@@ -26,6 +25,6 @@ bool mapper003_ppuRead(Mapper* mapper, uint16_t addr, uint8_t& data);
 bool mapper003_ppuWrite(Mapper* mapper, uint16_t addr, uint8_t data);
 uint8_t* mapper003_ppuReadPtr(Mapper* mapper, uint16_t addr);
 void mapper003_reset(Mapper* mapper);
-void mapper003_dumpState(Mapper* mapper, File& state);
-void mapper003_loadState(Mapper* mapper, File& state);
+void mapper003_dumpState(Mapper* mapper, StateStream& state);
+void mapper003_loadState(Mapper* mapper, StateStream& state);
 #endif
\ No newline at end of file
@@ -14,8 +14,6 @@ struct Mapper004_state
     uint8_t* ptr_PRG_bank_8K[4];
     uint8_t* ptr_CHR_bank_1K[8];
 
-    Bank PRG_banks_8K[MAPPER004_NUM_PRG_BANKS_8K];
-    Bank CHR_banks_1K[MAPPER004_NUM_CHR_BANKS_1K];
     BankCache PRG_cache_8K;
     BankCache CHR_cache_1K;
 
@@ -230,7 +228,7 @@ void mapper004_reset(Mapper* mapper)
     state->cart->setMirrorMode(Cartridge::MIRROR::HORIZONTAL);
 }
 
-void mapper004_dumpState(Mapper* mapper, File& state)
+void mapper004_dumpState(Mapper* mapper, StateStream& state)
 {
     Mapper004_state* s = (Mapper004_state*)mapper->state;
     state.write(s->bank_register, sizeof(s->bank_register));
@@ -272,7 +270,7 @@ void mapper004_dumpState(Mapper* mapper, File& state)
     }
 }
 
-void mapper004_loadState(Mapper* mapper, File& state)
+void mapper004_loadState(Mapper* mapper, StateStream& state)
 {
     Mapper004_state* s = (Mapper004_state*)mapper->state;
     state.read(s->bank_register, sizeof(s->bank_register));
@@ -295,8 +293,6 @@ void mapper004_loadState(Mapper* mapper, File& state)
         state.read(PRG_bank_8K, sizeof(PRG_bank_8K));
         state.read(CHR_bank_1K, sizeof(CHR_bank_1K));
 
-        invalidateCache(&s->PRG_cache_8K);
-        invalidateCache(&s->CHR_cache_1K);
         for (int i = 0; i < 4; i++)
             s->ptr_PRG_bank_8K[i] = getBank(&s->PRG_cache_8K, PRG_bank_8K[i], RomType::PRG);
         for (int i = 0; i < 8; i++)
@@ -328,11 +324,20 @@ Mapper createMapper004(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend,
     switch (backend)
     {
     case ROMBackend::LRU:
-        bankInit(&state->PRG_cache_8K, state->PRG_banks_8K, MAPPER004_NUM_PRG_BANKS_8K, 8U * 1024U,
-                 cart);
-        bankInit(&state->CHR_cache_1K, state->CHR_banks_1K, MAPPER004_NUM_CHR_BANKS_1K, 1U * 1024,
-                 cart);
+    {
+        BankCachePlan plans[2] = {
+            { (uint16_t)(PRG_banks * 2), 8U * 1024U, MAPPER004_MIN_PRG_BANKS_8K, 0 },
+            { (uint16_t)(CHR_banks * 8), 1U * 1024U, MAPPER004_MIN_CHR_BANKS_1K, 0 },
+        };
+        BankCache* caches[2] = { &state->PRG_cache_8K, &state->CHR_cache_1K };
+        if (!bankInitAll(caches, plans, 2, cart))
+        {
+            free(state->RAM);
+            delete state;
+            return mapper;
+        }
         break;
+    }
 
     case ROMBackend::FLASH: state->mROM = &cart->mROM; break;
     }
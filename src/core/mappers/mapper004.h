@@ -3,8 +3,8 @@
 
 #include "../mapper.h"
 
-#define MAPPER004_NUM_PRG_BANKS_8K 18
-#define MAPPER004_NUM_CHR_BANKS_1K 24
+#define MAPPER004_MIN_PRG_BANKS_8K 6
+#define MAPPER004_MIN_CHR_BANKS_1K 12
 
 Mapper createMapper004(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend, Cartridge* cart);
 
@@ -15,6 +15,6 @@ bool mapper004_ppuWrite(Mapper* mapper, uint16_t addr, uint8_t data);
 uint8_t* mapper004_ppuReadPtr(Mapper* mapper, uint16_t addr);
 void mapper004_scanline(Mapper* mapper);
 void mapper004_reset(Mapper* mapper);
-void mapper004_dumpState(Mapper* mapper, File& state);
-void mapper004_loadState(Mapper* mapper, File& state);
+void mapper004_dumpState(Mapper* mapper, StateStream& state);
+void mapper004_loadState(Mapper* mapper, StateStream& state);
 #endif
\ No newline at end of file
@@ -3,8 +3,8 @@
 
 #include "../mapper.h"
 
-#define MAPPER069_NUM_PRG_BANKS_8K 17
-#define MAPPER069_NUM_CHR_BANKS_1K 24
+#define MAPPER069_MIN_PRG_BANKS_8K 6
+#define MAPPER069_MIN_CHR_BANKS_1K 12
 
 Mapper createMapper069(uint8_t PRG_banks, uint8_t CHR_banks, ROMBackend backend, Cartridge* cart);
 
@@ -15,6 +15,6 @@ bool mapper069_ppuWrite(Mapper* mapper, uint16_t addr, uint8_t data);
 uint8_t* mapper069_ppuReadPtr(Mapper* mapper, uint16_t addr);
 void mapper069_cycle(Mapper* mapper, int cycles);
 void mapper069_reset(Mapper* mapper);
-void mapper069_dumpState(Mapper* mapper, File& state);
-void mapper069_loadState(Mapper* mapper, File& state);
+void mapper069_dumpState(Mapper* mapper, StateStream& state);
+void mapper069_loadState(Mapper* mapper, StateStream& state);
 #endif
\ No newline at end of file
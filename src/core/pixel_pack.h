@@ -0,0 +1,99 @@
+#ifndef PIXEL_PACK_H
+#define PIXEL_PACK_H
+
+#include <stdint.h>
+
+// Pixel format conversions for the screen. Plain functions with no hardware dependencies.
+
+// Drops the low bits of each RGB565 channel, giving 0x0RGB
+inline uint16_t rgb565To444(uint16_t color)
+{
+    return ((color >> 4) & 0xF00) | ((color >> 3) & 0x0F0) | ((color >> 1) & 0x00F);
+}
+
+// Packs count 0x0RGB pixels (count must be even) into the 3 byte per 2 pixel stream of the
+// 12-bit interface format: R0G0 B0R1 G1B1. Both pixels of a pair are read before their bytes
+// are written, so out may be the same buffer as pixels.
+inline void packRGB444(const uint16_t* pixels, uint8_t* out, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i += 2)
+    {
+        uint16_t a = pixels[i];
+        uint16_t b = pixels[i + 1];
+        out[0] = a >> 4;
+        out[1] = (a << 4) | (b >> 8);
+        out[2] = b;
+        out += 3;
+    }
+}
+
+// Source pixel and weight of the next source pixel in quarters for one output pixel of a
+// stretched line
+struct StretchTap
+{
+    uint8_t index;
+    uint8_t weight;
+};
+
+// Maps out_width output pixels onto in_width source pixels (in_width < out_width, at most 256).
+// Nearest samples the source pixel under each output pixel's center. Otherwise an output pixel
+// that straddles two source pixels mixes them by how much of each it covers, which keeps edges
+// sharp while spacing the pixels evenly.
+inline void buildStretchTaps(StretchTap* taps, uint16_t in_width, uint16_t out_width, bool nearest)
+{
+    for (uint16_t k = 0; k < out_width; k++)
+    {
+        // Output pixel k covers [start, end) in units of 1/out_width source pixels
+        uint32_t start = (uint32_t)k * in_width;
+        uint32_t end = start + in_width;
+        StretchTap& tap = taps[k];
+        if (nearest)
+        {
+            tap.index = (start + (in_width >> 1)) / out_width;
+            tap.weight = 0;
+            continue;
+        }
+        tap.index = start / out_width;
+        uint32_t boundary = (uint32_t)(tap.index + 1) * out_width;
+        uint32_t over = (end > boundary) ? end - boundary : 0;
+        tap.weight = (over * 4 + (in_width >> 1)) / in_width;
+        if (tap.weight == 4)
+        {
+            tap.index++;
+            tap.weight = 0;
+        }
+    }
+}
+
+// Mixes two RGB565 colors, weight in quarters towards b
+inline uint16_t blend565(uint16_t a, uint16_t b, uint8_t weight)
+{
+    uint32_t x = (a | ((uint32_t)a << 16)) & 0x07E0F81F;
+    uint32_t y = (b | ((uint32_t)b << 16)) & 0x07E0F81F;
+    uint32_t mix = ((x * (4 - weight) + y * weight) >> 2) & 0x07E0F81F;
+    return mix | (mix >> 16);
+}
+
+// Mixes two 0x0RGB colors, weight in quarters towards b
+inline uint16_t blend444(uint16_t a, uint16_t b, uint8_t weight)
+{
+    uint32_t x = (a & 0x0F0F) | ((uint32_t)(a & 0x00F0) << 12);
+    uint32_t y = (b & 0x0F0F) | ((uint32_t)(b & 0x00F0) << 12);
+    uint32_t mix = ((x * (4 - weight) + y * weight) >> 2) & 0x000F0F0F;
+    return (mix & 0x0F0F) | ((mix >> 12) & 0x00F0);
+}
+
+// Widens a line in place to count pixels. Written right to left: every output pixel lies at or
+// after its sources, so no source is overwritten before the last pixel that reads it.
+template <typename Blend>
+inline void stretchLine(uint16_t* line, const StretchTap* taps, uint16_t count, Blend blend)
+{
+    for (int k = count - 1; k >= 0; k--)
+    {
+        const StretchTap& tap = taps[k];
+        uint16_t a = line[tap.index];
+        line[k] = tap.weight ? blend(a, line[tap.index + 1], tap.weight) : a;
+    }
+}
+
+#endif
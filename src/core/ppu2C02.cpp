@@ -3,18 +3,21 @@
 
 #define READ_PALETTE(x) palette_table[((x) & 0x1F) ^ (((x) & 0x13) == 0x10 ? 0x10 : 0x00)]
 
+#ifdef BEAM_RACING
+BeamRing beam_ring;
+#endif
+
 #ifndef COMPOSITE_VIDEO
-    #ifdef DOUBLE_BUFFERING
-DMA_ATTR uint16_t Ppu2C02::display_buffer_front[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
-DMA_ATTR uint16_t Ppu2C02::display_buffer_back[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
-uint16_t* Ppu2C02::ptr_display = Ppu2C02::display_buffer_front;
-uint16_t* Ppu2C02::ptr_back_buffer = Ppu2C02::display_buffer_back;
-    #else
-DMA_ATTR uint16_t Ppu2C02::display_buffer[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
-    #endif
+// Used alone if there is no DMA memory left for the ring
+DMA_ATTR uint16_t Ppu2C02::display_buffer[DISPLAY_LINE_SIZE * (SCANLINES_PER_BUFFER >> 1)];
 #endif
 
 constexpr uint8_t Ppu2C02::palette_mirror[32];
+uint8_t Ppu2C02::sprite_index[240][8];
+uint8_t Ppu2C02::sprite_index_count[240];
+#ifdef CHR_TILE_CACHE
+Ppu2C02::CHRCacheEntry Ppu2C02::chr_cache[CHR_CACHE_ENTRIES];
+#endif
 
 Ppu2C02::Ppu2C02()
 {
@@ -28,28 +31,92 @@ Ppu2C02::Ppu2C02()
     memset(ptr_nametable, 0, sizeof(ptr_nametable));
     memset(nametable, 0, sizeof(nametable));
     memset(palette_table, 0, sizeof(palette_table));
-    memset(scanline_buffer, 0, sizeof(scanline_buffer));
-    memset(scanline_metadata, 0, sizeof(scanline_metadata));
+    memset(bg_opaque, 0, sizeof(bg_opaque));
+    memset(sprite_opaque, 0, sizeof(sprite_opaque));
     memset(sprite, 0, sizeof(sprite));
+#ifdef CHR_TILE_CACHE
+    invalidateCHRCache();
+#endif
 #ifndef COMPOSITE_VIDEO
-    #ifdef DOUBLE_BUFFERING
-    memset(display_buffer_front, 0, sizeof(display_buffer_front));
-    memset(display_buffer_back, 0, sizeof(display_buffer_back));
-    #else
     memset(display_buffer, 0, sizeof(display_buffer));
-    #endif
 #endif
 }
 
 Ppu2C02::~Ppu2C02()
 {
+#ifdef PARALLEL_RENDERING
+    if (renderer)
+    {
+        waitForRenderer();
+        vTaskDelete(render_task);
+        delete renderer;
+    }
+#endif
+#ifndef COMPOSITE_VIDEO
+    for (uint16_t* buffer : display_ring)
+        if (buffer != display_buffer) heap_caps_free(buffer);
+#endif
 }
 
+#ifndef COMPOSITE_VIDEO
+// Sizes the display buffer ring from the free DMA capable heap. Full size buffers are used if
+// at least two of them fit, otherwise half size ones. With DMA disabled, sending blocks until
+// done so one buffer is enough.
+void Ppu2C02::allocDisplayRing()
+{
+    #ifdef DISABLE_DMA
+    uint8_t count = 1;
+    #else
+    uint8_t count = DISPLAY_BUFFERS;
+    #endif
+    size_t available = heap_caps_get_free_size(MALLOC_CAP_DMA);
+    available = (available > DISPLAY_DMA_RESERVE) ? available - DISPLAY_DMA_RESERVE : 0;
+    uint8_t lines = SCANLINES_PER_BUFFER;
+    if (available < 2 * DISPLAY_LINE_SIZE * lines * sizeof(uint16_t)) lines >>= 1;
+    size_t size = DISPLAY_LINE_SIZE * lines * sizeof(uint16_t);
+    if (count > available / size) count = available / size;
+
+    display_buffers = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint16_t* buffer = (uint16_t*)heap_caps_malloc(size, MALLOC_CAP_DMA);
+        if (!buffer) break;
+        memset(buffer, 0, size);
+        display_ring[display_buffers++] = buffer;
+    }
+    if (display_buffers == 0)
+    {
+        display_ring[0] = display_buffer;
+        display_buffers = 1;
+        lines = SCANLINES_PER_BUFFER >> 1;
+    }
+
+    buffer_lines = lines;
+    ring_index = 0;
+    ptr_back_buffer = display_ring[0];
+    scanline_counter = 0;
+    LOGF("Display: %u buffers of %u lines\n", display_buffers, buffer_lines);
+}
+
+IRAM_ATTR void Ppu2C02::nextDisplayBuffer()
+{
+    if (++ring_index == display_buffers) ring_index = 0;
+    ptr_back_buffer = display_ring[ring_index];
+}
+#endif
+
 inline void Ppu2C02::ppuWrite(uint16_t addr, uint8_t data)
 {
     addr &= 0x3FFF;
 
-    if (cart->ppuWrite(addr, data)) return;
+    if (cart->ppuWrite(addr, data))
+    {
+#ifdef CHR_TILE_CACHE
+        // CHR RAM write, drop the decoded row holding this byte
+        if (addr < 0x2000) invalidateCHRRow(cart->ppuReadPtr(addr & ~0x0008));
+#endif
+        return;
+    }
     else if (addr >= 0x2000 && addr <= 0x3EFF)
     {
         ptr_nametable[(addr >> 10) & 3][addr & 0x03FF] = data;
@@ -58,6 +125,7 @@ inline void Ppu2C02::ppuWrite(uint16_t addr, uint8_t data)
     {
         addr = palette_mirror[addr & 0x001F];
         palette_table[addr] = data;
+        palette_dirty = true;
     }
 }
 
@@ -90,6 +158,9 @@ inline uint8_t Ppu2C02::ppuRead(uint16_t addr)
 
 IRAM_ATTR void Ppu2C02::cpuWrite(uint16_t addr, uint8_t data)
 {
+#ifdef MID_SCANLINE_RENDERING
+    if (log_writes && addr != 0x0003 && addr != 0x0004) logWrite(addr, data);
+#endif
     switch (addr)
     {
     case 0x0000: // PPUCTRL
@@ -98,13 +169,18 @@ IRAM_ATTR void Ppu2C02::cpuWrite(uint16_t addr, uint8_t data)
         t.nametable_y = control.nametable_y;
         break;
     case 0x0001: // PPUMASK
+        if ((mask.reg ^ data) & 0xE0) palette_dirty = true;
         mask.reg = data;
         break;
     case 0x0003: // OAMADDR
         OAMADDR = data;
         break;
     case 0x0004: // OAMDATA
+#ifdef PARALLEL_RENDERING
+        beforeSharedWrite();
+#endif
         ptr_sprite[OAMADDR++] = data;
+        sprite_index_dirty = true;
         break;
     case 0x0005: // PPUSCROLL
         if (w == 0)
@@ -129,6 +205,9 @@ IRAM_ATTR void Ppu2C02::cpuWrite(uint16_t addr, uint8_t data)
         w = ~w;
         break;
     case 0x0007: // PPUDATA
+#ifdef PARALLEL_RENDERING
+        beforeSharedWrite();
+#endif
         ppuWrite(v.reg, data);
         v.reg += (control.VRAM_addr_increment ? 32 : 1);
         break;
@@ -163,6 +242,10 @@ IRAM_ATTR uint8_t Ppu2C02::cpuRead(uint16_t addr)
 
 IRAM_ATTR void Ppu2C02::setVBlank()
 {
+#ifdef MID_SCANLINE_RENDERING
+    log_writes = false;
+    line_write_count = 0;
+#endif
     status.VBlank = 1;
     if (control.Vblank_NMI) bus->NMI();
 }
@@ -172,16 +255,87 @@ IRAM_ATTR void Ppu2C02::clearVBlank()
     status.VBlank = 0;
     status.sprite_zero_hit = 0;
     status.sprite_overflow = 0;
+    sprite_zero_cycle = -1;
+#ifdef PARALLEL_RENDERING
+    // Anything may have changed between frames, such as a loaded state or new settings
+    renderer_stale = true;
+#endif
 }
 
 IRAM_ATTR void Ppu2C02::renderScanline(uint16_t current_scanline)
 {
     scanline = current_scanline;
+    if (scanline < crop_lines || scanline >= 240 - crop_lines)
+    {
+        skipScanline();
+        return;
+    }
+#ifdef INTERLACED_RENDERING
+    // Lines of the other field keep what they showed last frame
+    if (field >= 0 && (scanline & 1) != field)
+    {
+        skipScanline();
+        return;
+    }
+#endif
+#ifdef PARALLEL_RENDERING
+    if (renderer)
+    {
+        // Core 0 draws the line, this core only keeps the scroll, the mapper scanline counter
+        // and sprite 0 hit running as for a skipped line. $2002 is read from this instance, so
+        // it owns every status bit and evaluates sprite overflow itself. The renderer's status
+        // is never read.
+        transferScroll();
+        logLine();
+        checkSpriteOverflow();
+        skipScanline();
+        return;
+    }
+#endif
+    if (palette_dirty) resolvePalette();
+
+    // Pixels are written straight into the display buffer. With the sides cropped, the hidden
+    // pixels of a line are never drawn on the left and overwritten by the next line on the right.
+#ifdef COMPOSITE_VIDEO
+    #ifdef BEAM_RACING
+    waitForBeam();
+    ptr_line = display_buffer + ((uint32_t)(scanline & (BEAM_RING_LINES - 1)) * SCANLINE_SIZE);
+    #else
+    ptr_line = display_buffer + ((uint32_t)scanline * SCANLINE_SIZE);
+    #endif
+#else
+    ptr_line = ptr_back_buffer + ((uint32_t)scanline_counter * line_width) - crop_left;
+#endif
     transferScroll();
+#ifdef MID_SCANLINE_RENDERING
+    if (line_write_count) renderSegments();
+    else renderBackground();
+#else
     renderBackground();
+#endif
     renderSprites();
     incrementY();
     finishScanline();
+    predictSpriteZeroHit(scanline + 1, true);
+}
+
+// Cropped lines and lines of the other field only keep the scroll, the mapper scanline counter
+// and sprite 0 hit running
+inline void Ppu2C02::skipScanline()
+{
+#ifdef MID_SCANLINE_RENDERING
+    line_write_count = 0;
+#endif
+    transferScroll();
+
+    // Hits on lines after the first are already predicted by the line before
+    if (sprite_zero_cycle < 0) predictSpriteZeroHit(scanline, true);
+    if (sprite_zero_cycle >= 0) status.sprite_zero_hit = 1;
+    sprite_zero_cycle = -1;
+
+    incrementY();
+    if (mask.render_background || mask.render_sprite) cart->ppuScanline();
+    predictSpriteZeroHit(scanline + 1, true);
 }
 
 inline void Ppu2C02::transferScroll()
@@ -215,24 +369,24 @@ inline void Ppu2C02::renderBackground()
     // Show transparency pixel if not rendering background
     if (!mask.render_background)
     {
-        uint8_t bg_color = palette_table[0];
-        memset(scanline_buffer, bg_color, BUFFER_SIZE);
-        memset(scanline_metadata, 0x80, BUFFER_SIZE);
-        ptr_buffer = scanline_buffer + x;
-        ptr_scanline_meta = scanline_metadata + x;
+        Pixel bg_color = resolved_palette[0];
+        for (int i = crop_left; i < SCANLINE_SIZE - crop_left; i++) ptr_line[i] = bg_color;
+        memset(bg_opaque, 0, sizeof(bg_opaque));
         return;
     }
 
-    uint8_t x_tile, y_tile, tile_index, nametable_index, bg_color;
+    uint8_t x_tile, y_tile, tile_index, nametable_index;
     uint8_t attribute_byte, attribute_shift, attribute;
     uint16_t offset, nametable_byte_base, attribute_byte_base;
     uint8_t* ptr_pattern_tile;
     uint8_t* ptr_attribute;
     uint8_t* ptr_tile;
+    uint8_t tile_opaque[33];
+    Pixel bg_color;
+    Pixel* ptr_pixel;
 
-    bg_color = palette_table[0];
-    ptr_buffer = scanline_buffer;
-    ptr_scanline_meta = scanline_metadata;
+    bg_color = resolved_palette[0];
+    ptr_pixel = ptr_line;
     x_tile = v.coarse_x;
     y_tile = v.coarse_y;
     offset = (control.background_table_addr ? 0x1000 : 0x0000) + v.fine_y;
@@ -247,27 +401,46 @@ inline void Ppu2C02::renderBackground()
     attribute_shift = ((y_tile & 2) << 1) + (x_tile & 2);
     attribute = ((attribute_byte >> attribute_shift) & 3) << 2;
 
+#ifndef CHR_TILE_CACHE
     // Shifts to get the bits of a pixel
     static constexpr DRAM_ATTR uint8_t pixel_shift[8] = { 14, 6, 12, 4, 10, 2, 8, 0 };
-    static constexpr DRAM_ATTR uint8_t pixel_metadata[4] = { 0x80, 0x00, 0x00, 0x00 };
+#endif
     for (int tile = 0; tile < 33; tile++)
     {
         tile_index = *ptr_tile++;
         ptr_pattern_tile = cart->ppuReadPtr(offset + (tile_index << 4));
+        tile_opaque[tile] = ptr_pattern_tile[0] | ptr_pattern_tile[8];
 
         // draw to framebuffer
+        // Fine X scroll clips the first and last tile to the visible line
+        int first = (tile == 0) ? x : 0;
+        int last = (tile == 32) ? x : 8;
+        // Skip the pixels under the left crop
+        if (crop_left && tile < 2)
+        {
+            int skip = (tile == 0) ? last - first : x;
+            ptr_pixel += skip;
+            first += skip;
+        }
+#ifdef CHR_TILE_CACHE
+        uint16_t pattern = getCHRRow(ptr_pattern_tile)->pixels << (first << 1);
+#else
         uint16_t pattern = ((ptr_pattern_tile[8] & 0xAA) << 8) |
                            ((ptr_pattern_tile[8] & 0x55) << 1) |
                            ((ptr_pattern_tile[0] & 0xAA) << 7) | (ptr_pattern_tile[0] & 0x55);
-        uint8_t tile_palette[4];
+#endif
+        Pixel tile_palette[4];
         tile_palette[0] = bg_color;
-        for (int t = 1; t < 4; t++) tile_palette[t] = READ_PALETTE(attribute + t);
-        for (int i = 0; i < 8; i++)
+        for (int t = 1; t < 4; t++) tile_palette[t] = resolved_palette[attribute + t];
+        for (int i = first; i < last; i++)
         {
+#ifdef CHR_TILE_CACHE
+            uint8_t pixel = pattern >> 14;
+            pattern <<= 2;
+#else
             uint8_t pixel = (pattern >> pixel_shift[i]) & 3;
-            *ptr_buffer++ = tile_palette[pixel];
-            *ptr_scanline_meta++ = pixel_metadata[pixel];
-            // Store if pixel is transparent for sprite rendering
+#endif
+            *ptr_pixel++ = tile_palette[pixel];
         }
 
         x_tile++;
@@ -293,7 +466,28 @@ inline void Ppu2C02::renderBackground()
             attribute = ((attribute_byte >> attribute_shift) & 0x03) << 2;
         }
     }
-    ptr_buffer = scanline_buffer + x;
+
+    // Store which pixels are opaque for sprite rendering, shifted by fine X scroll
+    for (int i = 0; i < 8; i++)
+    {
+        uint8_t* ptr = &tile_opaque[i << 2];
+        uint32_t word = ((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+        bg_opaque[i] = (word << x) | (ptr[4] >> (8 - x));
+    }
+}
+
+// Reads the 8 flags starting at pixel x, pixel x in the top bit
+static inline uint8_t readLineMask(const uint32_t* mask, uint8_t x)
+{
+    uint64_t window = ((uint64_t)mask[x >> 5] << 32) | mask[(x >> 5) + 1];
+    return window >> (56 - (x & 31));
+}
+
+static inline void setLineMask(uint32_t* mask, uint8_t x, uint8_t bits)
+{
+    uint64_t window = (uint64_t)bits << (56 - (x & 31));
+    mask[x >> 5] |= window >> 32;
+    mask[(x >> 5) + 1] |= (uint32_t)window;
 }
 
 inline void Ppu2C02::renderSprites()
@@ -301,42 +495,42 @@ inline void Ppu2C02::renderSprites()
     if (!mask.render_sprite) { return; }
 
     OAM* ptr_sprite_OAM;
-    uint8_t* buffer_offset;
-    uint8_t* metadata_offset;
+    Pixel* ptr_pixel;
     uint8_t* ptr_tile;
+    uint8_t* ptr_index;
     uint8_t sprite_x, sprite_y;
-    uint8_t sprite_size;
     uint8_t sprite_count = 0;
-    uint8_t tile_index, bg_color, attribute_byte, attribute, palette_offset;
+    uint8_t tile_index, attribute_byte, attribute, palette_offset;
+    uint8_t opaque, bg, drawn, draw;
     uint8_t pixel[8];
-    uint8_t tile_palette[4];
+    Pixel tile_palette[4];
     uint16_t offset, tile_addr, pattern;
     int16_t y_offset;
+    int width;
+
+    tile_palette[0] = resolved_palette[0];
+    memset(sprite_opaque, 0, sizeof(sprite_opaque));
 
-    bg_color = palette_table[0];
-    tile_palette[0] = bg_color;
+    if (sprite_index_dirty || sprite_index_size != control.sprite_size) buildSpriteIndex();
 
-    ptr_sprite_OAM = sprite;
     offset = (control.sprite_table_addr ? 0x1000 : 0);
-    sprite_size = (control.sprite_size ? 16 : 8);
 
-    buffer_offset = scanline_buffer + x;
-    metadata_offset = scanline_metadata + x;
-    for (int i = 0; i < 64; i++, ptr_sprite_OAM++)
+    // Only visit the sprites that are in this scanline, in OAM order
+    ptr_index = sprite_index[scanline];
+    for (int n = 0; n < sprite_index_count[scanline]; n++)
     {
+        int i = ptr_index[n];
+        ptr_sprite_OAM = &sprite[i];
         sprite_y = ptr_sprite_OAM->y + 1;
-        // Check if sprite is in scanline
-        if ((sprite_y > scanline) || (sprite_y <= (scanline - sprite_size)) || (sprite_y == 0) ||
-            (sprite_y >= 240))
-            continue;
 
         sprite_x = ptr_sprite_OAM->x;
         tile_index = ptr_sprite_OAM->index;
         attribute_byte = ptr_sprite_OAM->attribute;
         attribute = ((attribute_byte & 0x03) << 2);
 
-        ptr_buffer = buffer_offset + sprite_x;
-        ptr_scanline_meta = metadata_offset + sprite_x;
+        ptr_pixel = ptr_line + sprite_x;
+        // Sprites can hang off the right edge of the line
+        width = (sprite_x > SCANLINE_SIZE - 8) ? SCANLINE_SIZE - sprite_x : 8;
 
         // If 8x16 sprite mode
         tile_addr = (control.sprite_size) ? ((tile_index & 0x01) << 12) | ((tile_index & 0xFE) << 4)
@@ -353,13 +547,25 @@ inline void Ppu2C02::renderSprites()
         else ptr_tile += y_offset;
 
         // Draw to buffer
+#ifdef CHR_TILE_CACHE
+        CHRCacheEntry* row = getCHRRow(ptr_tile);
+        pattern = (attribute_byte & 0x40) ? row->flipped : row->pixels;
+#else
         pattern = ((ptr_tile[8] & 0xAA) << 8) | ((ptr_tile[8] & 0x55) << 1) |
                   ((ptr_tile[0] & 0xAA) << 7) | (ptr_tile[0] & 0x55);
+#endif
         if (pattern)
         {
             palette_offset = 16 + attribute;
-            for (int t = 1; t < 4; t++) tile_palette[t] = READ_PALETTE(palette_offset + t);
+            for (int t = 1; t < 4; t++) tile_palette[t] = resolved_palette[palette_offset + t];
 
+#ifdef CHR_TILE_CACHE
+            for (int j = 0; j < 8; j++)
+            {
+                pixel[j] = pattern >> 14;
+                pattern <<= 2;
+            }
+#else
             if (attribute_byte & 0x40) // If flip sprite horizontally
             {
                 pixel[7] = (pattern >> 14) & 3;
@@ -382,43 +588,30 @@ inline void Ppu2C02::renderSprites()
                 pixel[6] = (pattern >> 8) & 3;
                 pixel[7] = pattern & 3;
             }
+#endif
+
+            // Opaque sprite pixels, leftmost in the top bit
+            opaque = 0;
+            for (int j = 0; j < width; j++)
+                if (pixel[j]) opaque |= 0x80 >> j;
+            bg = readLineMask(bg_opaque, sprite_x);
+            drawn = readLineMask(sprite_opaque, sprite_x);
 
             // Check for sprite 0 hit
-            if (i == 0 && status.sprite_zero_hit == 0)
-            {
-                for (int j = 0; j < 8; j++)
-                {
-                    if (pixel[j] && ((ptr_scanline_meta[j] & 0x80) == 0))
-                    {
-                        status.sprite_zero_hit = true;
-                        break;
-                    }
-                }
-            }
+            if (i == 0 && (opaque & bg)) status.sprite_zero_hit = true;
 
             // Render sprite pixels on scanline buffer
             // Sprite Priorty : 1 - behind background | 0 - in front of background
-            if (attribute_byte & 0x20)
+            if (attribute_byte & 0x20) draw = opaque & ~bg;
+            else draw = opaque & ~drawn;
+            setLineMask(sprite_opaque, sprite_x, opaque);
+            if (sprite_x < crop_left) draw &= 0xFF >> (crop_left - sprite_x);
+
+            while (draw)
             {
-                for (int j = 0; j < 8; j++)
-                {
-                    if (pixel[j])
-                    {
-                        if (ptr_scanline_meta[j] & 0x80) ptr_buffer[j] = tile_palette[pixel[j]];
-                        ptr_scanline_meta[j] |= 0x40;
-                    }
-                }
-            }
-            else
-            {
-                for (int j = 0; j < 8; j++)
-                {
-                    if (pixel[j] && ((ptr_scanline_meta[j] & 0x40) == 0))
-                    {
-                        ptr_buffer[j] = tile_palette[pixel[j]];
-                        ptr_scanline_meta[j] |= 0x40;
-                    }
-                }
+                int j = __builtin_clz(draw) - 24;
+                ptr_pixel[j] = tile_palette[pixel[j]];
+                draw &= ~(0x80 >> j);
             }
         }
 
@@ -429,14 +622,135 @@ inline void Ppu2C02::renderSprites()
             break;
         }
     }
+}
+
+#ifdef PARALLEL_RENDERING
+// Sets sprite overflow on the line that renderSprites would stop at, without drawing. The sprite
+// index is shared with the renderer, so OAM is scanned directly.
+inline void Ppu2C02::checkSpriteOverflow()
+{
+    if (!mask.render_sprite || status.sprite_overflow) return;
 
-    ptr_buffer = buffer_offset;
+    uint8_t sprite_size = (control.sprite_size ? 16 : 8);
+    uint8_t sprite_count = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        uint8_t sprite_y = sprite[i].y + 1;
+        if ((sprite_y == 0) || (sprite_y >= 240)) continue;
+        if ((uint8_t)(scanline - sprite_y) >= sprite_size) continue;
+        if (++sprite_count == 8)
+        {
+            status.sprite_overflow = true;
+            return;
+        }
+    }
+}
+#endif
+
+void Ppu2C02::buildSpriteIndex()
+{
+    uint8_t sprite_size = (control.sprite_size ? 16 : 8);
+    memset(sprite_index_count, 0, sizeof(sprite_index_count));
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint8_t sprite_y = sprite[i].y + 1;
+        if ((sprite_y == 0) || (sprite_y >= 240)) continue;
+
+        int end = sprite_y + sprite_size;
+        if (end > 240) end = 240;
+        for (int line = sprite_y; line < end; line++)
+        {
+            uint8_t& count = sprite_index_count[line];
+            if (count < 8) sprite_index[line][count++] = i;
+        }
+    }
+
+    sprite_index_size = control.sprite_size;
+    sprite_index_dirty = false;
+}
+
+static inline uint8_t reverseBits(uint8_t b)
+{
+    b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4);
+    b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+    return ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+}
+
+// Finds the dot where sprite 0 first overlaps opaque background on the next line, so the CPU
+// batch for that line can be split to set the flag at the matching cycle
+inline void Ppu2C02::predictSpriteZeroHit(uint16_t line, bool check_background)
+{
+    if (!mask.render_sprite || status.sprite_zero_hit) return;
+
+    uint8_t sprite_size = (control.sprite_size ? 16 : 8);
+    uint8_t sprite_y = sprite[0].y + 1;
+    if ((sprite_y > line) || (sprite_y <= (line - sprite_size)) || (sprite_y == 0) ||
+        (sprite_y >= 240))
+        return;
+
+    uint8_t tile_index = sprite[0].index;
+    uint8_t attribute_byte = sprite[0].attribute;
+    uint16_t tile_addr = (control.sprite_size)
+                             ? ((tile_index & 0x01) << 12) | ((tile_index & 0xFE) << 4)
+                             : (control.sprite_table_addr ? 0x1000 : 0) + (tile_index << 4);
+    uint8_t* ptr_tile = cart->ppuReadPtr(tile_addr);
+
+    int16_t y_offset = (int16_t)(line - sprite_y);
+    if (y_offset > 7) y_offset += 8;
+    if (attribute_byte & 0x80) // If flip sprite vertically
+    {
+        y_offset -= (control.sprite_size) ? 23 : 7;
+        ptr_tile -= y_offset;
+    }
+    else ptr_tile += y_offset;
+
+    // Opaque sprite pixels, leftmost in the top bit
+    uint8_t opaque = ptr_tile[0] | ptr_tile[8];
+    if (attribute_byte & 0x40) opaque = reverseBits(opaque);
+
+    uint8_t sprite_x = sprite[0].x;
+    if (sprite_x > SCANLINE_SIZE - 8) opaque &= 0xFF << (sprite_x - (SCANLINE_SIZE - 8));
+    if (check_background)
+    {
+        if (!mask.render_background) return;
+        opaque &= backgroundOpacity(sprite_x);
+    }
+    if (!opaque) return;
+
+    uint16_t dot = sprite_x + (__builtin_clz(opaque) - 24) + 1;
+    sprite_zero_cycle = (dot + 2) / 3;
+}
+
+// Opaque background pixels of the next line starting at pixel_x, leftmost in the top bit
+inline uint8_t Ppu2C02::backgroundOpacity(uint8_t pixel_x)
+{
+    // The next line starts from the horizontal scroll in t
+    internal_register fetch;
+    fetch.reg = (v.reg & ~0x041F) | (t.reg & 0x041F);
+    uint16_t offset = (control.background_table_addr ? 0x1000 : 0x0000) + fetch.fine_y;
+    uint16_t position = pixel_x + x;
+
+    uint16_t bits = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        uint16_t coarse_x = fetch.coarse_x + (position >> 3) + i;
+        uint8_t nametable_index = ((fetch.reg >> 10) & 3) ^ ((coarse_x >> 5) & 1);
+        uint8_t tile_index = ptr_nametable[nametable_index][(fetch.reg & 0x03E0) + (coarse_x & 31)];
+        uint8_t* ptr_pattern_tile = cart->ppuReadPtr(offset + (tile_index << 4));
+        bits = (bits << 8) | (ptr_pattern_tile[0] | ptr_pattern_tile[8]);
+    }
+    return bits >> (8 - (position & 7));
 }
 
 void Ppu2C02::fakeSpriteHit(uint16_t current_scanline)
 {
+#ifdef MID_SCANLINE_RENDERING
+    line_write_count = 0;
+#endif
     if (mask.render_background || mask.render_sprite) cart->ppuScanline();
     if (!mask.render_sprite || status.sprite_zero_hit) return;
+    predictSpriteZeroHit(current_scanline + 1, false);
 
     uint8_t sprite_size;
     uint16_t offset = (control.sprite_table_addr ? 0x1000 : 0);
@@ -512,37 +826,378 @@ void Ppu2C02::fakeSpriteHit(uint16_t current_scanline)
     }
 }
 
+#ifdef MID_SCANLINE_RENDERING
+IRAM_ATTR void Ppu2C02::beginFrame()
+{
+    log_writes = true;
+    line_write_count = 0;
+}
+
+inline void Ppu2C02::logWrite(uint16_t addr, uint8_t data)
+{
+    // Keep the registers as they were at the start of the line for the first segment
+    if (line_write_count == 0) saveLineState(line_start);
+    if (line_write_count == MAX_LINE_WRITES) return;
+
+    LineWrite& entry = line_writes[line_write_count++];
+    entry.cycle = bus->cpu.batch_cycle;
+    entry.reg = addr;
+    entry.data = data;
+}
+
+void Ppu2C02::saveLineState(LineState& state)
+{
+    state.control = control.reg;
+    state.mask = mask.reg;
+    state.v = v.reg;
+    state.t = t.reg;
+    state.x = x;
+    state.w = w;
+    memcpy(state.palette_table, palette_table, sizeof(palette_table));
+}
+
+void Ppu2C02::restoreLineState(const LineState& state)
+{
+    control.reg = state.control;
+    mask.reg = state.mask;
+    v.reg = state.v;
+    t.reg = state.t;
+    x = state.x;
+    w = state.w;
+    memcpy(palette_table, state.palette_table, sizeof(palette_table));
+    palette_dirty = true;
+}
+
+// Draws the background of a line that had register writes while it was being drawn, as
+// segments split at the dot of each write. Register state afterwards matches the fast path.
+void Ppu2C02::renderSegments()
+{
+    LineState line_end;
+    saveLineState(line_end);
+
+    restoreLineState(line_start);
+    resolvePalette();
+    transferScroll();
+    memset(bg_opaque, 0, sizeof(bg_opaque));
+
+    uint16_t base = v.reg;
+    uint8_t phase = x;
+    uint16_t start = 0;
+    for (int i = 0; i <= line_write_count; i++)
+    {
+        uint16_t end = (i < line_write_count) ? line_writes[i].cycle * 3 : SCANLINE_SIZE;
+        if (end > SCANLINE_SIZE) end = SCANLINE_SIZE;
+        if (end > start)
+        {
+            renderBackgroundSegment(start, end, base, phase);
+
+            // Advance the fetch position to the end of the segment
+            uint16_t position = phase + (end - start);
+            internal_register fetch;
+            fetch.reg = base;
+            for (int tile = 0; tile < (position >> 3); tile++)
+            {
+                if (fetch.coarse_x == 31)
+                {
+                    fetch.coarse_x = 0;
+                    fetch.nametable_x = ~fetch.nametable_x;
+                }
+                else fetch.coarse_x++;
+            }
+            base = fetch.reg;
+            phase = position & 7;
+            start = end;
+        }
+        if (i == line_write_count) break;
+
+        // Apply the write to the registers the renderer reads
+        uint8_t data = line_writes[i].data;
+        switch (line_writes[i].reg)
+        {
+        case 0x0000:
+            control.reg = data;
+            t.nametable_x = control.nametable_x;
+            t.nametable_y = control.nametable_y;
+            break;
+        case 0x0001: mask.reg = data; break;
+        case 0x0005:
+            if (w == 0) t.coarse_x = data >> 3;
+            else
+            {
+                t.fine_y = data & 0x07;
+                t.coarse_y = data >> 3;
+            }
+            w = ~w;
+            break;
+        case 0x0006:
+            if (w == 0) { t.reg = (t.reg & 0x00FF) | (uint16_t)((data & 0x3F) << 8); }
+            else
+            {
+                // Rendering continues from the new address
+                t.reg = (t.reg & 0xFF00) | data;
+                v.reg = t.reg;
+                base = v.reg;
+            }
+            w = ~w;
+            break;
+        case 0x0007:
+            if ((v.reg & 0x3F00) == 0x3F00) palette_table[palette_mirror[v.reg & 0x001F]] = data;
+            v.reg += (control.VRAM_addr_increment ? 32 : 1);
+            break;
+        default: break;
+        }
+        resolvePalette();
+    }
+
+    restoreLineState(line_end);
+    resolvePalette();
+    line_write_count = 0;
+}
+
+void Ppu2C02::renderBackgroundSegment(uint16_t start, uint16_t end, uint16_t base,
+                                      uint8_t phase)
+{
+    if (!mask.render_background)
+    {
+        for (int i = (start < crop_left) ? crop_left : start; i < end; i++)
+            ptr_line[i] = resolved_palette[0];
+        return;
+    }
+
+    internal_register fetch;
+    fetch.reg = base;
+    uint16_t offset = (control.background_table_addr ? 0x1000 : 0x0000) + fetch.fine_y;
+    uint16_t pos = start;
+    uint8_t i = phase;
+    while (pos < end)
+    {
+        uint8_t* ptr_nametable_fetch = ptr_nametable[(fetch.reg >> 10) & 3];
+        uint8_t tile_index = ptr_nametable_fetch[fetch.reg & 0x03FF];
+        uint8_t attribute_byte =
+            ptr_nametable_fetch[0x03C0 + ((fetch.coarse_y & 0x1C) << 1) + (fetch.coarse_x >> 2)];
+        uint8_t attribute_shift = ((fetch.coarse_y & 2) << 1) + (fetch.coarse_x & 2);
+        uint8_t attribute = ((attribute_byte >> attribute_shift) & 3) << 2;
+        uint8_t* ptr_pattern_tile = cart->ppuReadPtr(offset + (tile_index << 4));
+
+        for (; i < 8 && pos < end; i++, pos++)
+        {
+            uint8_t pixel = ((ptr_pattern_tile[0] >> (7 - i)) & 1) |
+                            (((ptr_pattern_tile[8] >> (7 - i)) & 1) << 1);
+            if (pos >= crop_left) ptr_line[pos] = resolved_palette[pixel ? attribute + pixel : 0];
+            if (pixel) bg_opaque[pos >> 5] |= 0x80000000 >> (pos & 31);
+        }
+        i = 0;
+
+        if (fetch.coarse_x == 31)
+        {
+            fetch.coarse_x = 0;
+            fetch.nametable_x = ~fetch.nametable_x;
+        }
+        else fetch.coarse_x++;
+    }
+}
+#endif
+
 inline void Ppu2C02::finishScanline()
 {
     if (mask.render_background || mask.render_sprite) cart->ppuScanline();
+    storeLine();
+}
 
-// Transfer internal scanline buffer to display buffer
+// Send the display buffer once it is full
+inline void Ppu2C02::storeLine()
+{
+#ifdef BEAM_RACING
+    beam_ring.ready = beam_base + scanline + 1;
+#endif
 #ifndef COMPOSITE_VIDEO
-    #ifdef DOUBLE_BUFFERING
-    uint16_t* display = ptr_back_buffer + ((uint32_t)scanline_counter * SCANLINE_SIZE);
-    #else
-    uint16_t* display = ptr_display + ((uint32_t)scanline_counter * SCANLINE_SIZE);
+    #ifdef HORIZONTAL_STRETCH
+    if (stretch) stretchScanline(ptr_line + crop_left);
     #endif
-    uint8_t* buffer = ptr_buffer;
-    for (int i = 0; i < SCANLINE_SIZE; i++) display[i] = nes_palette[mask.emphasize][buffer[i]];
-
     scanline_counter++;
-    if (scanline_counter >= SCANLINES_PER_BUFFER)
+    if (scanline_counter >= buffer_lines)
     {
-    #ifdef DOUBLE_BUFFERING
-        uint16_t* temp = ptr_display;
-        ptr_display = ptr_back_buffer;
-        ptr_back_buffer = temp;
+    #ifdef RGB444_OUTPUT
+        // Packed in place, the packed lines take the first 3/4 of the buffer
+        if (rgb444)
+            packRGB444(ptr_back_buffer, (uint8_t*)ptr_back_buffer, line_width * buffer_lines);
+    #endif
+    #ifdef INTERLACED_RENDERING
+        // A field fills the buffer with every other line
+        if (field >= 0) bus->renderImage(scanline - ((buffer_lines - 1) << 1));
+        else bus->renderImage(scanline - (buffer_lines - 1));
+    #else
+        bus->renderImage(scanline - (buffer_lines - 1));
     #endif
-        bus->renderImage(scanline - (SCANLINES_PER_BUFFER - 1));
         scanline_counter = 0;
     }
-#else
-    uint8_t* buffer = ptr_buffer;
-    for (int i = 0; i < SCANLINE_SIZE; i++) display_buffer[scanline * 256 + i] = buffer[i] & 0x3F;
 #endif
 }
 
+#ifdef PARALLEL_RENDERING
+// Creates the second PPU that draws on core 0
+void Ppu2C02::startRenderer()
+{
+    renderer = new Ppu2C02();
+    renderer->bus = bus;
+    renderer_stale = true;
+    xTaskCreatePinnedToCore(renderTask, "Render Task", RENDER_TASK_STACK, this, 1, &render_task, 0);
+}
+
+// Lines take microseconds to draw, so waiting on the renderer polls at first. If another task on
+// core 0 holds it up, this core yields and then sleeps a tick at a time, so the idle task and
+// its watchdog still run.
+static inline void renderBackOff(uint32_t polls)
+{
+    if (polls < RENDER_SPIN_POLLS) return;
+    if (polls < RENDER_SPIN_POLLS * 2) taskYIELD();
+    else vTaskDelay(1);
+}
+
+// Waits until every logged line has been drawn
+IRAM_ATTR void Ppu2C02::waitForRenderer()
+{
+    uint32_t polls = 0;
+    while (log_tail.load(std::memory_order_acquire) != log_head.load(std::memory_order_relaxed))
+        renderBackOff(polls++);
+}
+
+// Called before writing memory that the renderer reads: nametables, palettes, CHR RAM, OAM and
+// mapper registers. Lines logged before the write are drawn with the old contents, and the
+// renderer copies the new ones before the next line. Nothing is logged until then, so a run of
+// writes such as a $2007 upload only waits for the queue once.
+IRAM_ATTR void Ppu2C02::beforeSharedWrite()
+{
+    if (!renderer || renderer_drained) return;
+    waitForRenderer();
+    renderer_drained = true;
+    renderer_stale = true;
+}
+
+inline void Ppu2C02::logLine()
+{
+    uint8_t head = log_head.load(std::memory_order_relaxed);
+    uint8_t next = (head + 1) % RENDER_QUEUE_LINES;
+    // Queue full, the renderer is behind
+    uint32_t polls = 0;
+    while (next == log_tail.load(std::memory_order_acquire)) renderBackOff(polls++);
+    if (renderer_stale) syncRenderer();
+    renderer_drained = false;
+
+    LoggedLine& line = line_log[head];
+    line.v = v.reg;
+    line.x = x;
+    line.control = control.reg;
+    line.mask = mask.reg;
+    line.scanline = scanline;
+    #ifdef INTERLACED_RENDERING
+    line.field = field;
+    #else
+    line.field = -1;
+    #endif
+    log_head.store(next, std::memory_order_release);
+    xTaskNotifyGive(render_task);
+}
+
+// Copies the memory and settings the renderer reads. Only called while it is idle.
+void Ppu2C02::syncRenderer()
+{
+    waitForRenderer();
+    renderer->cart = cart;
+    memcpy(renderer->ptr_nametable, ptr_nametable, sizeof(ptr_nametable));
+    memcpy(renderer->palette_table, palette_table, sizeof(palette_table));
+    memcpy(renderer->sprite, sprite, sizeof(sprite));
+    renderer->sprite_index_dirty = true;
+    renderer->nes_palette = nes_palette;
+    renderer->palette_dirty = true;
+    bool resized = renderer->crop_lines != crop_lines || renderer->crop_left != crop_left;
+    renderer->crop_lines = crop_lines;
+    renderer->crop_left = crop_left;
+    #ifdef HORIZONTAL_STRETCH
+    resized |= renderer->stretch != stretch;
+    renderer->stretch = stretch;
+    #endif
+    if (resized) renderer->updateLineWidth();
+    #ifdef RGB444_OUTPUT
+    renderer->rgb444 = rgb444;
+    #endif
+    renderer_stale = false;
+}
+
+IRAM_ATTR void Ppu2C02::drawLoggedLine(const LoggedLine& line)
+{
+    if ((mask.reg ^ line.mask) & 0xE0) palette_dirty = true;
+    v.reg = line.v;
+    x = line.x;
+    control.reg = line.control;
+    mask.reg = line.mask;
+    scanline = line.scanline;
+    #ifdef INTERLACED_RENDERING
+    field = line.field;
+    #endif
+    if (palette_dirty) resolvePalette();
+
+    ptr_line = ptr_back_buffer + ((uint32_t)scanline_counter * line_width) - crop_left;
+    renderBackground();
+    renderSprites();
+    storeLine();
+}
+
+void Ppu2C02::renderTask(void* parameter)
+{
+    Ppu2C02* ppu = (Ppu2C02*)parameter;
+    while (true)
+    {
+        uint8_t tail = ppu->log_tail.load(std::memory_order_relaxed);
+        if (tail == ppu->log_head.load(std::memory_order_acquire))
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        ppu->renderer->drawLoggedLine(ppu->line_log[tail]);
+        // Keep the DMA busy before letting the CPU side see the queue empty
+        ppu->bus->pumpImages();
+        ppu->log_tail.store((tail + 1) % RENDER_QUEUE_LINES, std::memory_order_release);
+    }
+}
+#endif
+
+#ifdef CHR_TILE_CACHE
+inline Ppu2C02::CHRCacheEntry* Ppu2C02::getCHRRow(const uint8_t* row)
+{
+    // Rows of a tile are 8 consecutive bytes followed by 8 bytes of the second bitplane,
+    // so dropping address bit 3 gives every row its own index
+    uintptr_t key = (uintptr_t)row;
+    CHRCacheEntry* entry = &chr_cache[(((key >> 4) << 3) | (key & 7)) & (CHR_CACHE_ENTRIES - 1)];
+    if (entry->row == row) return entry;
+
+    // Decode on miss
+    uint16_t pixels = 0, flipped = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint8_t pixel = ((row[0] >> (7 - i)) & 1) | (((row[8] >> (7 - i)) & 1) << 1);
+        pixels = (pixels << 2) | pixel;
+        flipped |= pixel << (i << 1);
+    }
+    entry->row = row;
+    entry->pixels = pixels;
+    entry->flipped = flipped;
+    return entry;
+}
+
+void Ppu2C02::invalidateCHRRow(const uint8_t* row)
+{
+    uintptr_t key = (uintptr_t)row;
+    CHRCacheEntry* entry = &chr_cache[(((key >> 4) << 3) | (key & 7)) & (CHR_CACHE_ENTRIES - 1)];
+    if (entry->row == row) entry->row = nullptr;
+}
+
+void Ppu2C02::invalidateCHRCache()
+{
+    memset(chr_cache, 0, sizeof(chr_cache));
+}
+#endif
+
 void Ppu2C02::reset()
 {
     status.reg = 0x00;
@@ -615,6 +1270,75 @@ Cartridge::MIRROR Ppu2C02::getMirror()
     return Cartridge::MIRROR::HORIZONTAL;
 }
 
+void Ppu2C02::setOverscan(uint8_t lines, bool crop_sides)
+{
+    // Only whole display buffers can be cropped
+    crop_lines = lines - (lines % SCANLINES_PER_BUFFER);
+    crop_left = crop_sides ? 8 : 0;
+    updateLineWidth();
+}
+
+void Ppu2C02::updateLineWidth()
+{
+    line_width = SCANLINE_SIZE - (crop_left << 1);
+#ifdef HORIZONTAL_STRETCH
+    if (stretch)
+    {
+        uint16_t width = line_width;
+        line_width = (width * 5) >> 2;
+        buildStretchTaps(stretch_taps, width, line_width, stretch == STRETCH_NEAREST);
+    }
+#endif
+    scanline_counter = 0;
+}
+
+#ifdef HORIZONTAL_STRETCH
+void Ppu2C02::setStretch(uint8_t mode)
+{
+    stretch = (mode < StretchCount) ? mode : STRETCH_OFF;
+    updateLineWidth();
+
+    #ifdef DEBUG
+    if (stretch == STRETCH_OFF) return;
+    // Compare a frame of stretched lines with a frame of plain line copies
+    static uint16_t line[STRETCH_WIDTH];
+    uint64_t start = esp_timer_get_time();
+    for (int i = 0; i < 240; i++)
+    {
+        memcpy(line, display_buffer, SCANLINE_SIZE * sizeof(uint16_t));
+        asm volatile("" ::: "memory");
+    }
+    uint32_t copy_time = esp_timer_get_time() - start;
+    start = esp_timer_get_time();
+    for (int i = 0; i < 240; i++) stretchScanline(line);
+    uint32_t stretch_time = esp_timer_get_time() - start;
+    LOGF("Stretch: %lu us per frame, line copy %lu us per frame\n", (unsigned long)stretch_time,
+         (unsigned long)copy_time);
+    #endif
+}
+
+// Widens a drawn line in place to line_width pixels. Blending is done on the colors in their
+// logical channel order, so byte swapped pixels are swapped around it.
+IRAM_ATTR void Ppu2C02::stretchScanline(uint16_t* line)
+{
+    #ifdef RGB444_OUTPUT
+    if (rgb444)
+    {
+        stretchLine(line, stretch_taps, line_width, blend444);
+        return;
+    }
+    #endif
+    #ifdef SCREEN_SWAP_BYTES
+    stretchLine(line, stretch_taps, line_width, [](uint16_t a, uint16_t b, uint8_t weight) {
+        uint16_t color = blend565((a << 8) | (a >> 8), (b << 8) | (b >> 8), weight);
+        return (uint16_t)((color << 8) | (color >> 8));
+    });
+    #else
+    stretchLine(line, stretch_taps, line_width, blend565);
+    #endif
+}
+#endif
+
 void Ppu2C02::setPalette(uint8_t palette)
 {
     switch (palette)
@@ -625,12 +1349,50 @@ void Ppu2C02::setPalette(uint8_t palette)
     case PAL222: nes_palette = palette_PAL222; break;
     default: break;
     }
+    palette_dirty = true;
+}
+
+#ifdef RGB444_OUTPUT
+void Ppu2C02::setRGB444(bool enable)
+{
+    rgb444 = enable;
+    palette_dirty = true;
+}
+#endif
+
+// Resolve the 32 palette entries to display colors
+inline void Ppu2C02::resolvePalette()
+{
+    for (int i = 0; i < 32; i++)
+    {
+#ifdef COMPOSITE_VIDEO
+        resolved_palette[i] = READ_PALETTE(i) & 0x3F;
+#else
+        resolved_palette[i] = nes_palette[mask.emphasize][READ_PALETTE(i) & 0x3F];
+    #ifdef RGB444_OUTPUT
+        if (rgb444)
+        {
+            uint16_t color = resolved_palette[i];
+        #ifdef SCREEN_SWAP_BYTES
+            color = (color << 8) | (color >> 8);
+        #endif
+            resolved_palette[i] = rgb565To444(color);
+        }
+    #endif
+#endif
+    }
+    palette_dirty = false;
 }
 
-void Ppu2C02::dumpState(File& state)
+void Ppu2C02::dumpState(StateStream& state)
 {
-    state.write((uint8_t*)scanline_buffer, sizeof(scanline_buffer));
-    state.write((uint8_t*)scanline_metadata, sizeof(scanline_metadata));
+    // Unused, keeps the save state file layout compatible
+    if (state.persistent())
+    {
+        static const uint8_t unused[BUFFER_SIZE] = { 0 };
+        state.write(unused, BUFFER_SIZE);
+        state.write(unused, BUFFER_SIZE);
+    }
     state.write(nametable, sizeof(nametable));
     for (int i = 0; i < 4; i++)
     {
@@ -656,10 +1418,9 @@ void Ppu2C02::dumpState(File& state)
     state.write((uint8_t*)&PPUDATA_buffer, sizeof(PPUDATA_buffer));
 }
 
-void Ppu2C02::loadState(File& state)
+void Ppu2C02::loadState(StateStream& state)
 {
-    state.read((uint8_t*)scanline_buffer, sizeof(scanline_buffer));
-    state.read((uint8_t*)scanline_metadata, sizeof(scanline_metadata));
+    if (state.persistent()) state.skip(BUFFER_SIZE * 2);
     state.read(nametable, sizeof(nametable));
     for (int i = 0; i < 4; i++)
     {
@@ -668,6 +1429,7 @@ void Ppu2C02::loadState(File& state)
         ptr_nametable[i] = &nametable[(map == 0) ? 0x0000 : 0x0400];
     }
     state.read(palette_table, sizeof(palette_table));
+    palette_dirty = true;
     state.read((uint8_t*)&scanline_counter, sizeof(scanline_counter));
 
     state.read((uint8_t*)&control.reg, sizeof(control.reg));
@@ -677,6 +1439,7 @@ void Ppu2C02::loadState(File& state)
     state.read((uint8_t*)&OAMDATA, sizeof(OAMDATA));
 
     state.read((uint8_t*)sprite, sizeof(sprite));
+    sprite_index_dirty = true;
     state.read((uint8_t*)&v.reg, sizeof(v.reg));
     state.read((uint8_t*)&t.reg, sizeof(t.reg));
     state.read((uint8_t*)&x, sizeof(x));
@@ -691,3 +1454,24 @@ void Ppu2C02::connectFramebuffer(uint8_t* framebuffer)
     ptr_display = display_buffer;
 #endif
 }
+
+#ifdef BEAM_RACING
+// Holds the line about to be drawn until the video ISR has sent the line whose ring slot it
+// reuses, keeping the PPU at most BEAM_RING_LINES lines ahead of the beam
+IRAM_ATTR void Ppu2C02::waitForBeam()
+{
+    if (scanline == 0)
+    {
+        // Frames follow each other, unless the beam already passed the first line. Then the frame
+        // goes to the next video frame, and the lines of this one are sent black.
+        beam_ring.blank = false;
+        beam_base += 240;
+        if ((int32_t)(beam_ring.shown - beam_base) > 0)
+        {
+            beam_base = beam_ring.frame_start + 240;
+            beam_ring.late_frames++;
+        }
+    }
+    while ((int32_t)(beam_ring.shown - beam_base) <= (int32_t)scanline - BEAM_RING_LINES) {}
+}
+#endif
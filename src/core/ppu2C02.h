@@ -2,24 +2,84 @@
 #define PPU2C02_H
 
 #include <Arduino.h>
+#include <atomic>
 #include <stdint.h>
 
 #include "../../config.h"
 #include "cartridge.h"
+#include "pixel_pack.h"
 
 #define BUFFER_SIZE          (256 + 8 + 8)
 #define SCANLINE_SIZE        256
-#define SCANLINES_PER_BUFFER 8
+#define SCANLINES_PER_BUFFER 8 // Most lines per display buffer, halved when DMA memory is short
 #define TILES_PER_SCANLINE   32
 #define PIXELS_PER_TILE      8
 
-#ifdef ILI9341_DRIVER
-    #define DOUBLE_BUFFERING
+#ifndef COMPOSITE_VIDEO
+    #ifndef DISPLAY_BUFFERS
+        #define DISPLAY_BUFFERS 4 // Most display buffers in the DMA ring
+    #endif
+    #define DISPLAY_DMA_RESERVE 16384 // DMA capable heap left free for the SD card and I2S
+#endif
+
+#ifdef MID_SCANLINE_RENDERING
+    #define MAX_LINE_WRITES 16
+#endif
+
+#if defined(PARALLEL_RENDERING) && (defined(COMPOSITE_VIDEO) || defined(MID_SCANLINE_RENDERING))
+    // Lines are logged whole, and composite video already keeps core 0 busy
+    #undef PARALLEL_RENDERING
+#endif
+
+#if defined(RGB444_OUTPUT) && (defined(COMPOSITE_VIDEO) || defined(ILI9341_DRIVER))
+    // The ILI9341 has no 12-bit interface pixel format
+    #undef RGB444_OUTPUT
+#endif
+
+#if defined(BEAM_RACING) && !defined(COMPOSITE_VIDEO)
+    #undef BEAM_RACING
+#endif
+
+#ifdef BEAM_RACING
+    // Every frame has to be drawn in time for the beam, there is no frame buffer to fall back on
+    #undef FRAMESKIP
+    #define BEAM_RING_LINES 32 // Lines the PPU can draw ahead of the video output, a power of 2
+
+// Lines drawn by the PPU on their way to the composite video ISR
+struct BeamRing
+{
+    uint8_t lines[BEAM_RING_LINES * SCANLINE_SIZE];
+    volatile uint32_t shown = 0;       // Active lines sent by the ISR since video started
+    volatile uint32_t frame_start = 0; // shown when the latest video frame's first line was sent
+    volatile uint32_t ready = 0;       // shown once every line drawn so far has been sent
+    volatile uint32_t underruns = 0;   // Lines sent black because they were not drawn in time
+    volatile bool blank = false;       // A frame is not being drawn, its lines are sent black
+    uint32_t late_frames = 0;          // Frames moved to the next video frame, the beam was ahead
+};
+extern BeamRing beam_ring;
+#endif
+
+#if defined(HORIZONTAL_STRETCH) && defined(COMPOSITE_VIDEO)
+    #undef HORIZONTAL_STRETCH
 #endif
 
-#ifdef DOUBLE_BUFFERING
-    #undef SCANLINES_PER_BUFFER
-    #define SCANLINES_PER_BUFFER 4
+#ifdef HORIZONTAL_STRETCH
+    #define STRETCH_WIDTH      320 // 5:4 of a full line
+    #define DISPLAY_LINE_SIZE  STRETCH_WIDTH
+#else
+    #define DISPLAY_LINE_SIZE  SCANLINE_SIZE
+#endif
+
+#ifdef PARALLEL_RENDERING
+    #define RENDER_QUEUE_LINES 16   // Logged lines the CPU can run ahead of the renderer
+    #define RENDER_TASK_STACK  4096
+    #define RENDER_SPIN_POLLS  2048 // Polls of the queue before waiting on the renderer yields
+#endif
+
+#ifdef CHR_TILE_CACHE
+    #ifndef CHR_CACHE_ENTRIES
+        #define CHR_CACHE_ENTRIES 1024 // Tile rows, must be a power of 2 (8 bytes each)
+    #endif
 #endif
 
 class Bus;
@@ -39,19 +99,44 @@ public:
     void fakeSpriteHit(uint16_t current_scanline);
     void setVBlank();
     void clearVBlank();
+    void setSpriteZeroHit()
+    {
+        status.sprite_zero_hit = 1;
+    }
+#ifdef MID_SCANLINE_RENDERING
+    void beginFrame();
+#endif
+#ifdef PARALLEL_RENDERING
+    void startRenderer();
+    void waitForRenderer();
+    void beforeSharedWrite();
+#endif
+    // The PPU that draws into the display buffers
+    Ppu2C02& display()
+    {
+#ifdef PARALLEL_RENDERING
+        if (renderer) return *renderer;
+#endif
+        return *this;
+    }
     void reset();
 
     void connectBus(Bus* n)
     {
         bus = n;
     }
+    void OAMWrite(uint8_t addr, uint8_t data)
+    {
+        ptr_sprite[addr] = data;
+        sprite_index_dirty = true;
+    }
     void connectCartridge(Cartridge* cartridge);
     void connectFramebuffer(uint8_t* framebuffer);
     void setMirror(Cartridge::MIRROR mirror);
     Cartridge::MIRROR getMirror();
 
-    void dumpState(File& state);
-    void loadState(File& state);
+    void dumpState(StateStream& state);
+    void loadState(StateStream& state);
 
     enum Palette : uint8_t
     {
@@ -62,6 +147,23 @@ public:
         PaletteCount
     };
     void setPalette(uint8_t palette);
+    void setOverscan(uint8_t lines, bool crop_sides);
+#ifdef RGB444_OUTPUT
+    void setRGB444(bool enable);
+#endif
+#ifdef HORIZONTAL_STRETCH
+    enum Stretch : uint8_t
+    {
+        STRETCH_OFF,
+        STRETCH_NEAREST,
+        STRETCH_SHARP,
+        StretchCount
+    };
+    void setStretch(uint8_t mode);
+#endif
+#ifdef CHR_TILE_CACHE
+    static void invalidateCHRCache();
+#endif
 
 private:
     Cartridge* cart = nullptr;
@@ -69,24 +171,113 @@ private:
 
     void renderBackground();
     void renderSprites();
+    void buildSpriteIndex();
+    void predictSpriteZeroHit(uint16_t line, bool check_background);
+    uint8_t backgroundOpacity(uint8_t pixel_x);
     void transferScroll();
     void incrementY();
     void finishScanline();
+    void storeLine();
+    void skipScanline();
+    void resolvePalette();
+#ifdef PARALLEL_RENDERING
+    // Registers a line is drawn with. Memory the renderer reads is only written once it has
+    // caught up, so the registers are all that changes between lines.
+    struct LoggedLine
+    {
+        uint16_t v;
+        uint8_t x;
+        uint8_t control;
+        uint8_t mask;
+        uint8_t scanline;
+        int8_t field;
+    };
+
+    // Second PPU on core 0 that draws the logged lines. Single producer, single consumer.
+    Ppu2C02* renderer = nullptr;
+    TaskHandle_t render_task = nullptr;
+    LoggedLine line_log[RENDER_QUEUE_LINES];
+    std::atomic<uint8_t> log_head{ 0 };
+    std::atomic<uint8_t> log_tail{ 0 };
+    bool renderer_stale = true;
+    bool renderer_drained = false; // Queue emptied by a shared write, no line logged since
+    void logLine();
+    void checkSpriteOverflow();
+    void syncRenderer();
+    void drawLoggedLine(const LoggedLine& line);
+    static void renderTask(void* parameter);
+#endif
+#ifdef MID_SCANLINE_RENDERING
+    struct LineWrite
+    {
+        uint8_t cycle;
+        uint8_t reg;
+        uint8_t data;
+    };
+    struct LineState
+    {
+        uint8_t control;
+        uint8_t mask;
+        uint16_t v;
+        uint16_t t;
+        uint8_t x;
+        uint8_t w;
+        uint8_t palette_table[32];
+    };
+
+    // Register writes made while the current visible line was being drawn
+    LineWrite line_writes[MAX_LINE_WRITES];
+    uint8_t line_write_count = 0;
+    LineState line_start;
+    bool log_writes = false;
+    void logWrite(uint16_t addr, uint8_t data);
+    void saveLineState(LineState& state);
+    void restoreLineState(const LineState& state);
+    void renderSegments();
+    void renderBackgroundSegment(uint16_t start, uint16_t end, uint16_t base, uint8_t phase);
+#endif
     uint8_t nametable[2048];
     uint8_t* ptr_nametable[4];
     uint8_t palette_table[32];
     uint8_t scanline_counter = 0;
-    uint8_t scanline_buffer[BUFFER_SIZE];
-    uint8_t scanline_metadata[BUFFER_SIZE];
+    // One bit per pixel, leftmost pixel of each word in the top bit. The extra word lets
+    // sprites at the right edge be read and written without bounds checks
+    uint32_t bg_opaque[SCANLINE_SIZE / 32 + 1];
+    uint32_t sprite_opaque[SCANLINE_SIZE / 32 + 1];
+
+    // First 8 sprites on each scanline, rebuilt after OAM or sprite size changes
+    static uint8_t sprite_index[240][8];
+    static uint8_t sprite_index_count[240];
+    bool sprite_index_dirty = true;
+    uint8_t sprite_index_size = 0;
+#ifdef CHR_TILE_CACHE
+    // Decoded tile rows keyed by the pointer to their first bitplane
+    struct CHRCacheEntry
+    {
+        const uint8_t* row;
+        uint16_t pixels;  // 2-bit pixels, leftmost in the top bits
+        uint16_t flipped; // Same row mirrored horizontally
+    };
+    static CHRCacheEntry chr_cache[CHR_CACHE_ENTRIES];
+    CHRCacheEntry* getCHRRow(const uint8_t* row);
+    void invalidateCHRRow(const uint8_t* row);
+#endif
 #ifdef COMPOSITE_VIDEO
     uint8_t* display_buffer = nullptr;
-#else
-    #ifdef ILI9341_DRIVER
-    static uint16_t display_buffer_front[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
-    static uint16_t display_buffer_back[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
-    #else
-    static uint16_t display_buffer[SCANLINE_SIZE * SCANLINES_PER_BUFFER];
+    #ifdef BEAM_RACING
+    uint32_t beam_base = 0; // beam_ring.shown when this frame's first line is sent
+    void waitForBeam();
     #endif
+#else
+    // Ring of display buffers. While one is drawn into, the others wait for or are being sent.
+    uint16_t* display_ring[DISPLAY_BUFFERS] = { nullptr };
+    uint8_t ring_index = 0;
+    static uint16_t display_buffer[DISPLAY_LINE_SIZE * (SCANLINES_PER_BUFFER >> 1)];
+#endif
+    void updateLineWidth();
+#ifdef HORIZONTAL_STRETCH
+    StretchTap stretch_taps[STRETCH_WIDTH];
+    void stretchScanline(uint16_t* line);
 #endif
 
     // clang-format off
@@ -768,6 +959,15 @@ private:
     // clang-format on
 
     const uint16_t (*nes_palette)[64] = palette_NTSC565;
+
+    // Palette RAM resolved to display colors, rebuilt after palette or emphasis writes
+#ifdef COMPOSITE_VIDEO
+    typedef uint8_t Pixel;
+#else
+    typedef uint16_t Pixel;
+#endif
+    Pixel resolved_palette[32];
+    bool palette_dirty = true;
     static constexpr uint8_t palette_mirror[32] = {
         0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
         0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x00, 0x11, 0x12, 0x13, 0x04, 0x15,
@@ -858,20 +1058,41 @@ private:
 
     // Rendering
     uint16_t scanline = 0x00;
-    uint8_t* ptr_scanline_meta = nullptr;
+    Pixel* ptr_line = nullptr;
 
 public:
+    // Overscan crop. Cropped lines are not drawn or sent to the screen, and lines are packed
+    // in the display buffer at line_width pixels apart.
+    uint8_t crop_lines = 0; // Lines hidden at the top and at the bottom
+    uint8_t crop_left = 0;  // Pixels hidden at the left and at the right
+    uint16_t line_width = SCANLINE_SIZE; // Pixels per line sent to the screen
+#ifdef HORIZONTAL_STRETCH
+    uint8_t stretch = STRETCH_OFF;
+#endif
+#ifdef INTERLACED_RENDERING
+    int8_t field = -1; // Parity of the lines drawn this frame, or -1 to draw them all
+#endif
+    int16_t sprite_zero_cycle = -1; // CPU cycle of a sprite 0 hit predicted for the next line
     uint8_t* ptr_sprite = (uint8_t*)sprite;
-    uint8_t* ptr_buffer = scanline_buffer;
 #ifdef COMPOSITE_VIDEO
     uint8_t* ptr_display;
 #else
-    #ifdef ILI9341_DRIVER
-    static uint16_t* ptr_display;
-    static uint16_t* ptr_back_buffer;
-    #else
-    static constexpr uint16_t* ptr_display = display_buffer;
+    uint16_t* ptr_back_buffer = display_buffer; // Display buffer being drawn into
+    uint8_t display_buffers = 1;
+    uint8_t buffer_lines = SCANLINES_PER_BUFFER >> 1;
+    #ifdef RGB444_OUTPUT
+    bool rgb444 = false; // Lines are packed to 12 bits per pixel before they are sent
+    #endif
+    // 16-bit words per line as sent to the screen
+    uint16_t lineWords() const
+    {
+    #ifdef RGB444_OUTPUT
+        if (rgb444) return (line_width * 3) >> 2;
     #endif
+        return line_width;
+    }
+    void allocDisplayRing();
+    void nextDisplayBuffer();
 #endif
 };
 
@@ -0,0 +1,232 @@
+#include "rewind.h"
+#include "../debug.h"
+#include "bus.h"
+
+// Delta encoding, one control byte per run:
+// 0x00-0x7F: the next n + 1 bytes are XORed into the state
+// 0x80-0xFF: the next (n & 0x7F) + 1 bytes are unchanged
+// Unchanged bytes at the end of the state are not stored.
+#define RUN_LENGTH 128
+
+// Writes a state over the newest one, encoding the XOR of the two into the ring as it goes
+class Rewind::DeltaEncoder : public StateStream
+{
+public:
+    DeltaEncoder(Rewind* rewind, bool encode) : r(rewind), encode(encode)
+    {
+    }
+
+    size_t write(const uint8_t* data, size_t size) override
+    {
+        if (size > r->state_size - position) size = r->state_size - position;
+        for (size_t i = 0; i < size; i++)
+        {
+            uint8_t delta = data[i] ^ r->latest[position];
+            r->latest[position++] = data[i];
+            if (encode) encodeByte(delta);
+        }
+        return size;
+    }
+    size_t read(uint8_t*, size_t) override
+    {
+        return 0;
+    }
+    void skip(size_t size) override
+    {
+        static const uint8_t zero[16] = { 0 };
+        while (size)
+        {
+            size_t n = (size > sizeof(zero)) ? sizeof(zero) : size;
+            write(zero, n);
+            size -= n;
+        }
+    }
+
+    // Returns the size of the encoded delta, or 0 if it did not fit in the ring
+    uint32_t finish()
+    {
+        if (literal_count) closeLiteral();
+        return overflow ? 0 : size;
+    }
+
+private:
+    Rewind* r;
+    bool encode;
+    bool overflow = false;
+    uint32_t position = 0;
+    uint32_t size = 0;
+    uint32_t literal_start = 0;
+    uint8_t literal_count = 0;
+    uint8_t zero_count = 0;
+
+    void encodeByte(uint8_t delta)
+    {
+        if (delta == 0)
+        {
+            if (literal_count) closeLiteral();
+            if (++zero_count == RUN_LENGTH) flushZeros();
+            return;
+        }
+
+        if (zero_count) flushZeros();
+        if (literal_count == 0)
+        {
+            literal_start = r->head;
+            put(0);
+        }
+        put(delta);
+        if (++literal_count == RUN_LENGTH) closeLiteral();
+    }
+
+    void flushZeros()
+    {
+        put(0x80 | (zero_count - 1));
+        zero_count = 0;
+    }
+
+    void closeLiteral()
+    {
+        if (!overflow) r->ring[literal_start] = literal_count - 1;
+        literal_count = 0;
+    }
+
+    void put(uint8_t byte)
+    {
+        if (overflow) return;
+        if (r->used == REWIND_BUFFER_SIZE)
+        {
+            // Make room by forgetting the oldest states
+            if (r->snapshots == 0)
+            {
+                overflow = true;
+                return;
+            }
+            r->dropOldest();
+        }
+        r->ring[r->head] = byte;
+        r->head = (r->head + 1) % REWIND_BUFFER_SIZE;
+        r->used++;
+        size++;
+    }
+};
+
+bool Rewind::begin(Bus* bus)
+{
+    this->bus = bus;
+
+    state_size = bus->stateSize();
+
+    latest = (uint8_t*)calloc(state_size, 1);
+    ring = (uint8_t*)malloc(REWIND_BUFFER_SIZE);
+    records = (Record*)malloc(REWIND_MAX_SNAPSHOTS * sizeof(Record));
+    if (!latest || !ring || !records)
+    {
+        LOG("Rewind: not enough memory");
+        end();
+        return false;
+    }
+
+    LOGF("Rewind: %lu byte states, %u KB history\n", (unsigned long)state_size,
+         REWIND_BUFFER_SIZE / 1024);
+    return true;
+}
+
+void Rewind::end()
+{
+    free(latest);
+    free(ring);
+    free(records);
+    latest = nullptr;
+    ring = nullptr;
+    records = nullptr;
+    has_state = false;
+    snapshots = 0;
+    head = 0;
+    used = 0;
+}
+
+// Takes a snapshot every REWIND_INTERVAL frames
+void Rewind::frame()
+{
+    if (!latest) return;
+    if (++frame_counter < REWIND_INTERVAL) return;
+    frame_counter = 0;
+    capture();
+}
+
+void Rewind::capture()
+{
+    if (snapshots == REWIND_MAX_SNAPSHOTS) dropOldest();
+
+    // The first state has nothing to be a delta against
+    uint32_t start = head;
+    DeltaEncoder encoder(this, has_state);
+    bus->dumpState(encoder);
+    uint32_t size = encoder.finish();
+
+    if (has_state && size == 0)
+    {
+        // The delta did not fit even in an empty ring, start the history over
+        LOG("Rewind: state delta too large, history cleared");
+        snapshots = 0;
+        head = 0;
+        used = 0;
+        return;
+    }
+
+    if (has_state)
+    {
+        Record& record = records[(first_record + snapshots) % REWIND_MAX_SNAPSHOTS];
+        record.start = start;
+        record.size = size;
+        snapshots++;
+    }
+    has_state = true;
+}
+
+// Loads the newest snapshot, then makes the one before it the newest
+bool Rewind::step()
+{
+    if (!has_state) return false;
+
+    MemoryStateStream stream(latest, state_size);
+    bus->loadState(stream);
+    frame_counter = 0;
+    if (snapshots == 0) return false;
+
+    snapshots--;
+    Record& record = records[(first_record + snapshots) % REWIND_MAX_SNAPSHOTS];
+    uint32_t index = record.start;
+    uint32_t remaining = record.size;
+    uint32_t position = 0;
+    while (remaining)
+    {
+        uint8_t control = ring[index];
+        index = (index + 1) % REWIND_BUFFER_SIZE;
+        remaining--;
+
+        uint32_t count = (control & 0x7F) + 1;
+        if (control & 0x80)
+        {
+            position += count;
+            continue;
+        }
+        for (uint32_t i = 0; i < count && position < state_size; i++)
+        {
+            latest[position++] ^= ring[index];
+            index = (index + 1) % REWIND_BUFFER_SIZE;
+        }
+        remaining -= count;
+    }
+
+    head = record.start;
+    used -= record.size;
+    return true;
+}
+
+void Rewind::dropOldest()
+{
+    used -= records[first_record].size;
+    first_record = (first_record + 1) % REWIND_MAX_SNAPSHOTS;
+    snapshots--;
+}
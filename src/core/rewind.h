@@ -0,0 +1,60 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "state_stream.h"
+
+#ifndef REWIND_BUFFER_SIZE
+    #define REWIND_BUFFER_SIZE (32U * 1024U) // Bytes of compressed history
+#endif
+#ifndef REWIND_INTERVAL
+    #define REWIND_INTERVAL 4 // Frames between snapshots
+#endif
+#define REWIND_MAX_SNAPSHOTS 256
+// Heap taken by begin(): the history ring, the newest state and the 8 byte snapshot records
+#define REWIND_HEAP_SIZE     (REWIND_BUFFER_SIZE + STATE_MAX_SIZE + REWIND_MAX_SNAPSHOTS * 8U)
+
+class Bus;
+
+// Keeps a ring of past states in RAM. Only the newest state is stored in full; every older one
+// is stored as the XOR of it and the state after it, run-length encoded, since most of the
+// state does not change between snapshots.
+class Rewind
+{
+public:
+    bool begin(Bus* bus);
+    void end();
+    void frame();
+    bool step();
+
+    uint16_t snapshots = 0; // Older states that can be stepped back to
+
+private:
+    class DeltaEncoder;
+
+    struct Record
+    {
+        uint32_t start;
+        uint32_t size;
+    };
+
+    Bus* bus = nullptr;
+    uint8_t* latest = nullptr; // Newest state in full
+    uint32_t state_size = 0;
+    bool has_state = false;
+    uint8_t frame_counter = 0;
+
+    // Ring of encoded deltas, newest last
+    uint8_t* ring = nullptr;
+    uint32_t head = 0;
+    uint32_t used = 0;
+    Record* records = nullptr;
+    uint16_t first_record = 0;
+
+    void capture();
+    void dropOldest();
+};
+
+#endif
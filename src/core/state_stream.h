@@ -0,0 +1,167 @@
+#ifndef STATE_STREAM_H
+#define STATE_STREAM_H
+
+#include <SD.h>
+#include <cstring>
+#include <stdint.h>
+
+// Most bytes a state snapshot in RAM can take: CPU RAM, nametables, OAM, palettes, the largest
+// mapper state (8 KB of PRG RAM and 8 KB of CHR RAM) and room for the registers
+#define STATE_MAX_SIZE (2048U + 2048U + 256U + 32U + 16U * 1024U + 256U)
+
+// Where dumpState() writes to and loadState() reads from, so the same field lists can save
+// states to the SD card or snapshot them in RAM
+class StateStream
+{
+public:
+    virtual ~StateStream()
+    {
+    }
+    virtual size_t write(const uint8_t* data, size_t size) = 0;
+    virtual size_t read(uint8_t* data, size_t size) = 0;
+    virtual void skip(size_t size) = 0;
+    // Saved to the SD card, where the layout has to stay compatible with older save states.
+    // Snapshots in RAM leave out the parts kept only for that.
+    virtual bool persistent() const
+    {
+        return false;
+    }
+};
+
+// Batches the many small reads and writes of a state into large SD transfers through a RAM
+// buffer. With a buffer as large as the state, saving is one sequential write.
+class FileStateStream : public StateStream
+{
+public:
+    FileStateStream(File& file, uint8_t* buffer, size_t capacity)
+        : file(file), buffer(buffer), capacity(capacity)
+    {
+    }
+    ~FileStateStream()
+    {
+        flush();
+    }
+    size_t write(const uint8_t* data, size_t size) override
+    {
+        writing = true;
+        for (size_t left = size; left;)
+        {
+            size_t n = (left > capacity - count) ? capacity - count : left;
+            memcpy(buffer + count, data, n);
+            count += n;
+            data += n;
+            left -= n;
+            if (count == capacity) flush();
+        }
+        return size;
+    }
+    size_t read(uint8_t* data, size_t size) override
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            if (position == count)
+            {
+                count = file.read(buffer, capacity);
+                position = 0;
+                if (count == 0) break;
+            }
+            size_t n = (size - total > count - position) ? count - position : size - total;
+            memcpy(data + total, buffer + position, n);
+            position += n;
+            total += n;
+        }
+        return total;
+    }
+    void skip(size_t size) override
+    {
+        if (size <= count - position)
+        {
+            position += size;
+            return;
+        }
+        file.seek(file.position() + size - (count - position));
+        position = count = 0;
+    }
+    bool persistent() const override
+    {
+        return true;
+    }
+    void flush()
+    {
+        if (writing && count) file.write(buffer, count);
+        count = 0;
+    }
+
+private:
+    File& file;
+    uint8_t* buffer;
+    size_t capacity;
+    size_t count = 0;    // Bytes in the buffer
+    size_t position = 0; // Read position in the buffer
+    bool writing = false;
+};
+
+class MemoryStateStream : public StateStream
+{
+public:
+    MemoryStateStream(uint8_t* buffer, size_t size) : buffer(buffer), size(size)
+    {
+    }
+    size_t write(const uint8_t* data, size_t length) override
+    {
+        if (length > size - position) length = size - position;
+        memcpy(buffer + position, data, length);
+        position += length;
+        return length;
+    }
+    size_t read(uint8_t* data, size_t length) override
+    {
+        if (length > size - position) length = size - position;
+        memcpy(data, buffer + position, length);
+        position += length;
+        return length;
+    }
+    void skip(size_t length) override
+    {
+        position = (length > size - position) ? size : position + length;
+    }
+
+private:
+    uint8_t* buffer;
+    size_t size;
+    size_t position = 0;
+};
+
+// Only counts the bytes written, to size buffers for a state
+class CountingStateStream : public StateStream
+{
+public:
+    explicit CountingStateStream(bool persistent = false) : file_layout(persistent)
+    {
+    }
+    size_t write(const uint8_t*, size_t size) override
+    {
+        count += size;
+        return size;
+    }
+    size_t read(uint8_t*, size_t) override
+    {
+        return 0;
+    }
+    void skip(size_t size) override
+    {
+        count += size;
+    }
+    bool persistent() const override
+    {
+        return file_layout;
+    }
+
+    size_t count = 0;
+
+private:
+    bool file_layout;
+};
+
+#endif
@@ -415,7 +415,19 @@ void UI::settingsMenu(Bus* nes)
     int select = 0;
 
     constexpr int window_w = 124;
-    constexpr int window_h = 104;
+    // Each optional item adds a row to the window
+    constexpr int optional_items = 0
+#ifdef RUN_AHEAD
+                                   + 1
+#endif
+#ifdef RGB444_OUTPUT
+                                   + 1
+#endif
+#ifdef HORIZONTAL_STRETCH
+                                   + 1
+#endif
+        ;
+    constexpr int window_h = 104 + 12 * optional_items;
     int window_x = screen->width() - window_w;
     constexpr int window_y = 16;
     screen->fillRect(window_x, window_y, window_w, window_h, BAR_COLOR);
@@ -428,21 +440,67 @@ void UI::settingsMenu(Bus* nes)
     static char volume_text[15];
     static char palette_text[20];
     static char brightness_text[20];
+    static char overscan_text[20];
+    static char crop_sides_text[20];
+#ifdef RUN_AHEAD
+    static char run_ahead_text[20];
+#endif
+#ifdef RGB444_OUTPUT
+    static char colors_text[20];
+#endif
+#ifdef HORIZONTAL_STRETCH
+    static char stretch_text[20];
+    const char* stretch_names[] = { "Off", "Nearest", "Sharp" };
+#endif
     static char save_return_text[] = "Save & Return";
     const char* palette_names[] = { "NTSC 565", "PAL 565", "NTSC 222", "PAL 222" };
 
     snprintf(volume_text, sizeof(volume_text), "Volume: %d%%", settings.volume);
     snprintf(palette_text, sizeof(palette_text), "Palette: %s", palette_names[settings.palette]);
     snprintf(brightness_text, sizeof(brightness_text), "Brightness: %d%%", settings.brightness);
-    char* items[] = { volume_text, brightness_text, palette_text, save_return_text };
+    snprintf(overscan_text, sizeof(overscan_text), "Overscan: %d lines", settings.overscan);
+    snprintf(crop_sides_text, sizeof(crop_sides_text), "Crop sides: %s",
+             settings.crop_sides ? "On" : "Off");
+#ifdef RUN_AHEAD
+    snprintf(run_ahead_text, sizeof(run_ahead_text), "Run-ahead: %d", nes->run_ahead);
+#endif
+#ifdef RGB444_OUTPUT
+    snprintf(colors_text, sizeof(colors_text), "Colors: %s", settings.rgb444 ? "12-bit" : "16-bit");
+#endif
+#ifdef HORIZONTAL_STRETCH
+    snprintf(stretch_text, sizeof(stretch_text), "Stretch: %s", stretch_names[settings.stretch]);
+#endif
+    char* items[] = { volume_text,   brightness_text, palette_text,
+                      overscan_text, crop_sides_text,
+#ifdef RUN_AHEAD
+                      run_ahead_text,
+#endif
+#ifdef RGB444_OUTPUT
+                      colors_text,
+#endif
+#ifdef HORIZONTAL_STRETCH
+                      stretch_text,
+#endif
+                      save_return_text };
     enum ItemSelect
     {
         Volume,
         Brightness,
         Palette,
+        Overscan,
+        CropSides,
+#ifdef RUN_AHEAD
+        RunAhead,
+#endif
+#ifdef RGB444_OUTPUT
+        Colors,
+#endif
+#ifdef HORIZONTAL_STRETCH
+        Stretch,
+#endif
         Back
     };
-    constexpr int16_t items_y[] = { 30, 42, 54, 66 };
+    constexpr int16_t items_y[] = { 30, 42, 54, 66, 78, 90, 102, 114, 126 };
     constexpr int num_items = sizeof(items) / sizeof(items[0]);
     constexpr int item_height = 12;
     constexpr int text_height = 8;
@@ -530,6 +588,52 @@ void UI::settingsMenu(Bus* nes)
                                      SELECTED_BG_COLOR);
                     drawText(items[Palette], window_x + 12, items_y[Palette] + text_padding);
                     break;
+                case Overscan:
+                    if (settings.overscan >= 8) settings.overscan -= 8;
+                    snprintf(overscan_text, sizeof(overscan_text), "Overscan: %d lines",
+                             settings.overscan);
+                    screen->fillRect(window_x + 10, items_y[Overscan], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Overscan], window_x + 12, items_y[Overscan] + text_padding);
+                    break;
+                case CropSides:
+                    settings.crop_sides = !settings.crop_sides;
+                    snprintf(crop_sides_text, sizeof(crop_sides_text), "Crop sides: %s",
+                             settings.crop_sides ? "On" : "Off");
+                    screen->fillRect(window_x + 10, items_y[CropSides], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[CropSides], window_x + 12, items_y[CropSides] + text_padding);
+                    break;
+#ifdef RUN_AHEAD
+                case RunAhead:
+                    if (nes->run_ahead > 0) nes->run_ahead--;
+                    snprintf(run_ahead_text, sizeof(run_ahead_text), "Run-ahead: %d",
+                             nes->run_ahead);
+                    screen->fillRect(window_x + 10, items_y[RunAhead], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[RunAhead], window_x + 12, items_y[RunAhead] + text_padding);
+                    break;
+#endif
+#ifdef RGB444_OUTPUT
+                case Colors:
+                    settings.rgb444 = !settings.rgb444;
+                    snprintf(colors_text, sizeof(colors_text), "Colors: %s",
+                             settings.rgb444 ? "12-bit" : "16-bit");
+                    screen->fillRect(window_x + 10, items_y[Colors], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Colors], window_x + 12, items_y[Colors] + text_padding);
+                    break;
+#endif
+#ifdef HORIZONTAL_STRETCH
+                case Stretch:
+                    settings.stretch = (settings.stretch + Ppu2C02::StretchCount - 1) % Ppu2C02::StretchCount;
+                    snprintf(stretch_text, sizeof(stretch_text), "Stretch: %s",
+                             stretch_names[settings.stretch]);
+                    screen->fillRect(window_x + 10, items_y[Stretch], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Stretch], window_x + 12, items_y[Stretch] + text_padding);
+                    break;
+#endif
                 default: break;
                 }
                 last_input_time = now;
@@ -563,6 +667,52 @@ void UI::settingsMenu(Bus* nes)
                                      SELECTED_BG_COLOR);
                     drawText(items[Palette], window_x + 12, items_y[Palette] + text_padding);
                     break;
+                case Overscan:
+                    if (settings.overscan <= 8) settings.overscan += 8;
+                    snprintf(overscan_text, sizeof(overscan_text), "Overscan: %d lines",
+                             settings.overscan);
+                    screen->fillRect(window_x + 10, items_y[Overscan], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Overscan], window_x + 12, items_y[Overscan] + text_padding);
+                    break;
+                case CropSides:
+                    settings.crop_sides = !settings.crop_sides;
+                    snprintf(crop_sides_text, sizeof(crop_sides_text), "Crop sides: %s",
+                             settings.crop_sides ? "On" : "Off");
+                    screen->fillRect(window_x + 10, items_y[CropSides], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[CropSides], window_x + 12, items_y[CropSides] + text_padding);
+                    break;
+#ifdef RUN_AHEAD
+                case RunAhead:
+                    if (nes->run_ahead < RUN_AHEAD_MAX) nes->run_ahead++;
+                    snprintf(run_ahead_text, sizeof(run_ahead_text), "Run-ahead: %d",
+                             nes->run_ahead);
+                    screen->fillRect(window_x + 10, items_y[RunAhead], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[RunAhead], window_x + 12, items_y[RunAhead] + text_padding);
+                    break;
+#endif
+#ifdef RGB444_OUTPUT
+                case Colors:
+                    settings.rgb444 = !settings.rgb444;
+                    snprintf(colors_text, sizeof(colors_text), "Colors: %s",
+                             settings.rgb444 ? "12-bit" : "16-bit");
+                    screen->fillRect(window_x + 10, items_y[Colors], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Colors], window_x + 12, items_y[Colors] + text_padding);
+                    break;
+#endif
+#ifdef HORIZONTAL_STRETCH
+                case Stretch:
+                    settings.stretch = (settings.stretch + 1) % Ppu2C02::StretchCount;
+                    snprintf(stretch_text, sizeof(stretch_text), "Stretch: %s",
+                             stretch_names[settings.stretch]);
+                    screen->fillRect(window_x + 10, items_y[Stretch], window_w - 19, item_height,
+                                     SELECTED_BG_COLOR);
+                    drawText(items[Stretch], window_x + 12, items_y[Stretch] + text_padding);
+                    break;
+#endif
                 default: break;
                 }
                 last_input_time = now;
@@ -575,6 +725,9 @@ void UI::settingsMenu(Bus* nes)
                 case Back:
                     loadEmulatorSettings(nes);
                     saveSettings(&settings);
+#ifdef RUN_AHEAD
+                    saveGameSettings(nes);
+#endif
                     return;
                 default: break;
                 }
@@ -618,8 +771,47 @@ void UI::loadEmulatorSettings(Bus* nes)
 {
     nes->ppu.setPalette(settings.palette);
     nes->cpu.apu.setVolume(settings.volume);
+    nes->ppu.setOverscan(settings.overscan, settings.crop_sides);
+#ifdef RGB444_OUTPUT
+    nes->ppu.setRGB444(settings.rgb444);
+#endif
+#ifdef HORIZONTAL_STRETCH
+    nes->ppu.setStretch(settings.stretch);
+#endif
+}
+
+#ifdef RUN_AHEAD
+void UI::saveGameSettings(Bus* nes)
+{
+    if (!SD.exists("/settings")) SD.mkdir("/settings");
+
+    static char filename[32];
+    sprintf(filename, "/settings/%08lX.bin", (unsigned long)nes->cart->CRC32);
+    File f = SD.open(filename, FILE_WRITE);
+    if (!f) return;
+
+    GameSettings game;
+    game.run_ahead = nes->run_ahead;
+    f.write((uint8_t*)&game, sizeof(game));
+    f.close();
 }
 
+void UI::loadGameSettings(Bus* nes)
+{
+    static char filename[32];
+    sprintf(filename, "/settings/%08lX.bin", (unsigned long)nes->cart->CRC32);
+
+    GameSettings game;
+    File f = SD.open(filename, FILE_READ);
+    if (f)
+    {
+        if (f.size() == sizeof(GameSettings)) f.read((uint8_t*)&game, sizeof(game));
+        f.close();
+    }
+    nes->run_ahead = (game.run_ahead > RUN_AHEAD_MAX) ? RUN_AHEAD_MAX : game.run_ahead;
+}
+#endif
+
 void UI::restoreBrightness()
 {
     if (runtime_config.backlight) setBrightness(settings.brightness);
@@ -645,17 +837,19 @@ void UI::loadSettings(Settings* s)
 {
     File f = SD.open("/settings.bin", FILE_READ);
     if (!f) return;
-    if (f.size() != sizeof(Settings))
+    size_t size = f.size();
+    if (size == 0 || size > sizeof(Settings))
     {
         f.close();
         Settings temp = { 100, 100, 0 };
         saveSettings(&temp);
         *s = temp;
-        f.close();
         return;
     }
 
-    f.read((uint8_t*)s, sizeof(*s));
+    // Files from older versions end early, the fields added since keep their defaults
+    *s = Settings();
+    f.read((uint8_t*)s, size);
     f.close();
 }
 
@@ -41,6 +41,15 @@ public:
 
     void initializeSettings();
     void loadEmulatorSettings(Bus* nes);
+#ifdef RUN_AHEAD
+    // Settings saved per game in /settings/<CRC32>.bin
+    struct GameSettings
+    {
+        uint8_t run_ahead = 0;
+    };
+    void saveGameSettings(Bus* nes);
+    void loadGameSettings(Bus* nes);
+#endif
     void restoreBrightness();
     bool paused = false;
 
@@ -66,6 +75,10 @@ private:
         uint8_t brightness = 100;
         uint8_t palette = 0;
         uint8_t rom_backend = 0;
+        uint8_t overscan = 0;   // Lines cropped at the top and bottom
+        uint8_t crop_sides = 0; // Crop 8 pixels at the left and right
+        uint8_t rgb444 = 0;     // Send 12 bits per pixel instead of 16
+        uint8_t stretch = 0;    // Ppu2C02::Stretch mode widening the picture to 5:4
     };
     Settings settings;
     void saveSettings(const Settings* s);
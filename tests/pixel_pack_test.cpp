@@ -0,0 +1,106 @@
+// Host test for the pixel packing kernels in src/core/pixel_pack.h. Not part of the firmware.
+// g++ -std=c++11 -Wall -o pixel_pack_test tests/pixel_pack_test.cpp && ./pixel_pack_test
+
+#include "../src/core/pixel_pack.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t nextRandom()
+{
+    rng_state = rng_state * 1664525 + 1013904223;
+    return rng_state >> 8;
+}
+
+// Writes each pixel as 12 bits, red nibble first, into a big-endian bit stream
+static void referencePack(const uint16_t* pixels, uint8_t* out, uint32_t count)
+{
+    memset(out, 0, count * 3 / 2);
+    uint32_t bit = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        for (int b = 11; b >= 0; b--, bit++)
+        {
+            if ((pixels[i] >> b) & 1) out[bit >> 3] |= 0x80 >> (bit & 7);
+        }
+    }
+}
+
+static bool testPackInPlace(uint32_t count)
+{
+    static uint16_t line[512];
+    static uint16_t source[512];
+    static uint8_t expected[768];
+
+    for (uint32_t i = 0; i < count; i++) source[i] = nextRandom() & 0x0FFF;
+    // Fill the tail with a marker to catch writes past the packed bytes
+    for (uint32_t i = 0; i < 512; i++) line[i] = i < count ? source[i] : 0xA5A5;
+
+    referencePack(source, expected, count);
+    packRGB444(line, (uint8_t*)line, count);
+
+    const uint8_t* packed = (const uint8_t*)line;
+    uint32_t bytes = count * 3 / 2;
+    for (uint32_t i = 0; i < bytes; i++)
+    {
+        if (packed[i] != expected[i])
+        {
+            printf("packRGB444 count %u: byte %u is 0x%02X, expected 0x%02X\n", count, i,
+                   packed[i], expected[i]);
+            return false;
+        }
+    }
+    // The packed line ends at bytes, so the rest of the input must be untouched
+    const uint8_t* original = (const uint8_t*)source;
+    for (uint32_t i = bytes; i < (count << 1); i++)
+    {
+        if (packed[i] != original[i])
+        {
+            printf("packRGB444 count %u: overwrote input byte %u past the packed line\n", count,
+                   i);
+            return false;
+        }
+    }
+    for (uint32_t i = (count << 1); i < sizeof(line); i++)
+    {
+        if (packed[i] != 0xA5)
+        {
+            printf("packRGB444 count %u: wrote past the end at byte %u\n", count, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool testRgb565To444()
+{
+    for (uint32_t color = 0; color < 0x10000; color++)
+    {
+        uint16_t r = (color >> 11) >> 1;
+        uint16_t g = ((color >> 5) & 0x3F) >> 2;
+        uint16_t b = (color & 0x1F) >> 1;
+        uint16_t expected = (r << 8) | (g << 4) | b;
+        if (rgb565To444(color) != expected)
+        {
+            printf("rgb565To444 0x%04X is 0x%03X, expected 0x%03X\n", color, rgb565To444(color),
+                   expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    bool ok = testRgb565To444();
+    const uint32_t counts[] = { 2, 4, 30, 240, 256, 320, 512 };
+    for (uint32_t count : counts)
+    {
+        for (int run = 0; run < 16; run++) ok &= testPackInPlace(count);
+    }
+
+    printf(ok ? "pixel_pack: all tests passed\n" : "pixel_pack: FAILED\n");
+    return ok ? 0 : 1;
+}